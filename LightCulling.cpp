@@ -0,0 +1,262 @@
+//
+//  LightCulling.cpp
+//
+
+#include "LightCulling.hpp"
+
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+using namespace glm;
+
+CpuLightCuller::CpuLightCuller(int tilesX, int tilesY, unsigned threadCount) :
+	tilesX(tilesX), tilesY(tilesY), threadCount(threadCount)
+{
+	if (this->threadCount == 0)
+		this->threadCount = std::max(1u, std::thread::hardware_concurrency());
+	tileLights.resize(tilesX * tilesY);
+	grid.resize(tilesX * tilesY);
+}
+
+const char* CpuLightCuller::simdName()
+{
+#if SIMD_WIDTH == 8
+	return "AVX";
+#elif SIMD_WIDTH == 4
+	return "SSE";
+#else
+	return "scalar";
+#endif
+}
+
+void CpuLightCuller::cull(const std::vector<Light>& lights, const mat4& view, const mat4& projection,
+	const std::vector<vec2>& tileDepthBounds)
+{
+	// structure of arrays, padded so the vector loop never reads past the end
+	size_t paddedCount = (lights.size() + SIMD_WIDTH - 1) / SIMD_WIDTH * SIMD_WIDTH;
+	lightX.assign(paddedCount, 0.0f);
+	lightY.assign(paddedCount, 0.0f);
+	lightZ.assign(paddedCount, 0.0f);
+	lightRadius.assign(paddedCount, 0.0f);
+	for (size_t i = 0; i < lights.size(); ++i)
+	{
+		lightX[i] = lights[i].positionAndRadius.x;
+		lightY[i] = lights[i].positionAndRadius.y;
+		lightZ[i] = lights[i].positionAndRadius.z;
+		lightRadius[i] = lights[i].positionAndRadius.w;
+	}
+	uint32_t lightCount = (uint32_t)lights.size();
+
+	mat4 viewProjection = projection * view;
+
+	// tile rows are handed out to the workers one at a time
+	std::atomic<int> nextRow(0);
+	auto worker = [&]()
+	{
+		std::vector<uint32_t> visible;
+		for (int y = nextRow++; y < tilesY; y = nextRow++)
+		{
+			for (int x = 0; x < tilesX; ++x)
+			{
+				int index = y * tilesX + x;
+				visible.clear();
+				cullTile(x, y, lights, view, viewProjection, tileDepthBounds[index], visible);
+				// drop the padded lanes
+				while (!visible.empty() && visible.back() >= lightCount)
+					visible.pop_back();
+				tileLights[index] = visible;
+			}
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (unsigned i = 1; i < threadCount; ++i)
+		workers.emplace_back(worker);
+	worker();
+	for (auto& thread : workers)
+		thread.join();
+
+	// flatten into the GPU layout
+	indices.clear();
+	for (size_t i = 0; i < tileLights.size(); ++i)
+	{
+		grid[i].offset = (uint32_t)indices.size();
+		grid[i].count = (uint32_t)tileLights[i].size();
+		indices.insert(indices.end(), tileLights[i].begin(), tileLights[i].end());
+	}
+}
+
+void CpuLightCuller::cullTile(int tileX, int tileY, const std::vector<Light>& lights, const mat4& view,
+	const mat4& viewProjection, vec2 depthBounds, std::vector<uint32_t>& visible) const
+{
+	float minDepth = depthBounds.x;
+	float maxDepth = depthBounds.y;
+
+	// same construction as light_culling_comp.glsl
+	vec2 negativeStep = (2.0f * vec2(tileX, tileY)) / vec2(tilesX, tilesY);
+	vec2 positiveStep = (2.0f * vec2(tileX + 1, tileY + 1)) / vec2(tilesX, tilesY);
+
+	vec4 planes[6];
+	planes[0] = vec4(1.0f, 0.0f, 0.0f, 1.0f - negativeStep.x); // Left
+	planes[1] = vec4(-1.0f, 0.0f, 0.0f, -1.0f + positiveStep.x); // Right
+	planes[2] = vec4(0.0f, 1.0f, 0.0f, 1.0f - negativeStep.y); // Bottom
+	planes[3] = vec4(0.0f, -1.0f, 0.0f, -1.0f + positiveStep.y); // Top
+	planes[4] = vec4(0.0f, 0.0f, -1.0f, -minDepth); // Near
+	planes[5] = vec4(0.0f, 0.0f, 1.0f, maxDepth); // Far
+
+	for (int i = 0; i < 4; ++i)
+	{
+		planes[i] = planes[i] * viewProjection;
+		planes[i] /= length(vec3(planes[i]));
+	}
+	for (int i = 4; i < 6; ++i)
+	{
+		planes[i] = planes[i] * view;
+		planes[i] /= length(vec3(planes[i]));
+	}
+
+	size_t paddedCount = lightX.size();
+#if SIMD_WIDTH == 8
+	for (size_t i = 0; i < paddedCount; i += 8)
+	{
+		__m256 x = _mm256_loadu_ps(&lightX[i]);
+		__m256 y = _mm256_loadu_ps(&lightY[i]);
+		__m256 z = _mm256_loadu_ps(&lightZ[i]);
+		__m256 radius = _mm256_loadu_ps(&lightRadius[i]);
+		__m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+		for (int j = 0; j < 6; ++j)
+		{
+			__m256 distance = _mm256_add_ps(_mm256_set1_ps(planes[j].w), radius);
+			distance = _mm256_add_ps(distance, _mm256_mul_ps(x, _mm256_set1_ps(planes[j].x)));
+			distance = _mm256_add_ps(distance, _mm256_mul_ps(y, _mm256_set1_ps(planes[j].y)));
+			distance = _mm256_add_ps(distance, _mm256_mul_ps(z, _mm256_set1_ps(planes[j].z)));
+			inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, _mm256_setzero_ps(), _CMP_GT_OQ));
+		}
+		for (int mask = _mm256_movemask_ps(inside); mask != 0; mask &= mask - 1)
+		{
+			int lane = 0;
+			while (!(mask & (1 << lane)))
+				++lane;
+			visible.push_back(uint32_t(i + lane));
+		}
+	}
+#elif SIMD_WIDTH == 4
+	for (size_t i = 0; i < paddedCount; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(&lightX[i]);
+		__m128 y = _mm_loadu_ps(&lightY[i]);
+		__m128 z = _mm_loadu_ps(&lightZ[i]);
+		__m128 radius = _mm_loadu_ps(&lightRadius[i]);
+		__m128 inside = _mm_cmpeq_ps(radius, radius);
+		for (int j = 0; j < 6; ++j)
+		{
+			__m128 distance = _mm_add_ps(_mm_set1_ps(planes[j].w), radius);
+			distance = _mm_add_ps(distance, _mm_mul_ps(x, _mm_set1_ps(planes[j].x)));
+			distance = _mm_add_ps(distance, _mm_mul_ps(y, _mm_set1_ps(planes[j].y)));
+			distance = _mm_add_ps(distance, _mm_mul_ps(z, _mm_set1_ps(planes[j].z)));
+			inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, _mm_setzero_ps()));
+		}
+		int mask = _mm_movemask_ps(inside);
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if (mask & (1 << lane))
+				visible.push_back(uint32_t(i + lane));
+		}
+	}
+#else
+	for (size_t i = 0; i < paddedCount; ++i)
+	{
+		vec4 position(lightX[i], lightY[i], lightZ[i], 1.0f);
+		bool inside = true;
+		for (int j = 0; j < 6 && inside; ++j)
+			inside = dot(position, planes[j]) + lightRadius[i] > 0.0f;
+		if (inside)
+			visible.push_back(uint32_t(i));
+	}
+#endif
+
+	// tight test of the spot and capsule lights that passed with their bounding sphere
+	visible.erase(std::remove_if(visible.begin(), visible.end(), [&](uint32_t i)
+	{
+		if (i >= lights.size() || lights[i].shape.w == 0.0f)
+			return false;
+		for (int j = 0; j < 6; ++j)
+		{
+			if (LightPlaneDistance(lights[i], planes[j]) <= 0.0f)
+				return true;
+		}
+		return false;
+	}), visible.end());
+}
+
+void StaticLightGrid::build(const std::vector<Light>& lights, size_t count)
+{
+	cells.clear();
+	indices.clear();
+	dimensions = ivec3(0);
+	if (count == 0)
+		return;
+
+	// bounds of the light spheres, so every light lies fully inside the grid
+	vec3 maxBounds(-INFINITY);
+	minBounds = vec3(INFINITY);
+	float radiusSum = 0.0f;
+	for (size_t i = 0; i < count; ++i)
+	{
+		vec3 position(lights[i].positionAndRadius);
+		float radius = lights[i].positionAndRadius.w;
+		minBounds = min(minBounds, position - radius);
+		maxBounds = max(maxBounds, position + radius);
+		radiusSum += radius;
+	}
+
+	// cells about a light across keep each light in a handful of cells
+	vec3 extent = max(maxBounds - minBounds, vec3(1e-3f));
+	float targetSize = max(2.0f * radiusSum / count, 1e-3f);
+	dimensions = clamp(ivec3(ceil(extent / targetSize)), ivec3(1), ivec3(MAX_DIMENSION));
+	cellSize = extent / vec3(dimensions);
+
+	std::vector<std::vector<uint32_t>> cellLights(dimensions.x * dimensions.y * dimensions.z);
+	for (size_t i = 0; i < count; ++i)
+	{
+		vec3 position(lights[i].positionAndRadius);
+		float radius = lights[i].positionAndRadius.w;
+		ivec3 first = clamp(ivec3(floor((position - radius - minBounds) / cellSize)), ivec3(0), dimensions - 1);
+		ivec3 last = clamp(ivec3(floor((position + radius - minBounds) / cellSize)), ivec3(0), dimensions - 1);
+		for (int z = first.z; z <= last.z; ++z)
+		{
+			for (int y = first.y; y <= last.y; ++y)
+			{
+				for (int x = first.x; x <= last.x; ++x)
+				{
+					// sphere against the cell box, the corner cells of the sphere bounds often miss
+					vec3 cellMin = minBounds + vec3(x, y, z) * cellSize;
+					vec3 closest = clamp(position, cellMin, cellMin + cellSize);
+					vec3 offset = closest - position;
+					if (dot(offset, offset) <= radius * radius)
+						cellLights[(z * dimensions.y + y) * dimensions.x + x].push_back(uint32_t(i));
+				}
+			}
+		}
+	}
+
+	cells.resize(cellLights.size());
+	for (size_t i = 0; i < cellLights.size(); ++i)
+	{
+		cells[i].offset = (uint32_t)indices.size();
+		cells[i].count = (uint32_t)cellLights[i].size();
+		indices.insert(indices.end(), cellLights[i].begin(), cellLights[i].end());
+	}
+}
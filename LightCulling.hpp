@@ -0,0 +1,136 @@
+//
+//  LightCulling.hpp
+//
+//  CPU reference of the tiled light culling in shaders/light_culling_comp.glsl.
+//  Needs no GL context, so it doubles as a correctness oracle for the GPU pass
+//  and as a culling benchmark on machines without a GPU.
+//
+
+#ifndef LightCulling_hpp
+#define LightCulling_hpp
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+#include <cstdint>
+#include <vector>
+
+// 40 byte light record. The GPU keeps it as three streams, positionAndRadius
+// and shape are all the culling passes read and color is only read by the
+// final pass. positionAndRadius is a bounding sphere of every light type, so
+// sphere tests stay conservative and the shape only tightens them:
+//   point    shape.w == 0
+//   spot     shape.w > 0, cosine of the cone angle, xyz unit direction, w radius is the range
+//   capsule  shape.w < 0, minus the range around the segment, xyz half the segment
+// Must match lightPlaneDistance in the culling shaders and final_shading_frag.glsl.
+struct Light {
+    glm::vec4 positionAndRadius;  // xyz world position, w bounding radius
+    glm::uvec2 color;             // RGBA as four half floats
+    glm::vec4 shape;              // type dependent, see above
+};
+static_assert(sizeof(Light) == 40, "Light must stay tightly packed");
+
+inline glm::uvec2 PackLightColor(glm::vec4 color)
+{
+    return glm::uvec2(glm::packHalf2x16(glm::vec2(color.r, color.g)), glm::packHalf2x16(glm::vec2(color.b, color.a)));
+}
+
+inline Light MakePointLight(glm::vec3 position, float radius, glm::vec4 color)
+{
+    return Light{ glm::vec4(position, radius), PackLightColor(color), glm::vec4(0.0f) };
+}
+
+// angle is the half angle of the cone in radians, kept below 90 degrees
+inline Light MakeSpotLight(glm::vec3 position, glm::vec3 direction, float range, float angle, glm::vec4 color)
+{
+    float cosAngle = glm::max(glm::cos(angle), 1e-3f);
+    return Light{ glm::vec4(position, range), PackLightColor(color), glm::vec4(glm::normalize(direction), cosAngle) };
+}
+
+// lights everything within range of the segment center - halfAxis to center + halfAxis
+inline Light MakeCapsuleLight(glm::vec3 center, glm::vec3 halfAxis, float range, glm::vec4 color)
+{
+    return Light{ glm::vec4(center, glm::length(halfAxis) + range), PackLightColor(color), glm::vec4(halfAxis, -range) };
+}
+
+// Signed distance of the farthest point of the light volume to a normalized
+// plane, the light is outside the plane when it is <= 0
+inline float LightPlaneDistance(const Light& light, glm::vec4 plane)
+{
+    float center = glm::dot(glm::vec3(light.positionAndRadius), glm::vec3(plane)) + plane.w;
+    float sphere = center + light.positionAndRadius.w;
+    float axis = glm::dot(glm::vec3(light.shape), glm::vec3(plane));
+    if (light.shape.w > 0.0f)
+    {
+        // spot cone clipped to the range sphere, the apex or the rim of the base is farthest
+        float range = light.positionAndRadius.w;
+        float baseRadius = range * glm::sqrt(1.0f - light.shape.w * light.shape.w) / light.shape.w;
+        float base = center + range * axis + baseRadius * glm::sqrt(glm::max(1.0f - axis * axis, 0.0f));
+        return glm::min(sphere, glm::max(center, base));
+    }
+    if (light.shape.w < 0.0f)
+    {
+        // capsule, the farther segment end plus the range
+        return center + glm::abs(axis) - light.shape.w;
+    }
+    return sphere;
+}
+
+// (offset, count) of a light list in a flat index array
+struct LightGridCell {
+    uint32_t offset;
+    uint32_t count;
+};
+
+// World space uniform grid over lights that never move, built once when they
+// change. Every cell lists the lights whose bounding sphere overlaps its box,
+// so gathering the cells in the frustum finds every static light in view
+// without testing each one every frame.
+class StaticLightGrid
+{
+public:
+    // cells per axis stay within this, large scenes get larger cells
+    static const int MAX_DIMENSION = 64;
+
+    // Grids lights [0, count), the cell size follows the average light diameter
+    void build(const std::vector<Light>& lights, size_t count);
+
+    glm::vec3 minBounds = glm::vec3(0.0f);
+    glm::vec3 cellSize = glm::vec3(1.0f);
+    glm::ivec3 dimensions = glm::ivec3(0);
+
+    // same compact layout as CpuLightCuller, cells x fastest, then y, then z
+    std::vector<LightGridCell> cells;
+    std::vector<uint32_t> indices;
+};
+
+class CpuLightCuller
+{
+public:
+    CpuLightCuller(int tilesX, int tilesY, unsigned threadCount = 0);
+
+    // Culls the lights against every tile, tileDepthBounds holds the linear
+    // min/max view depth per tile as written by depth_reduction_comp.glsl
+    void cull(const std::vector<Light>& lights, const glm::mat4& view, const glm::mat4& projection,
+              const std::vector<glm::vec2>& tileDepthBounds);
+
+    // Same compact layout as the GPU light grid and index pool, lights ascending per tile
+    std::vector<LightGridCell> grid;
+    std::vector<uint32_t> indices;
+
+    int tilesX, tilesY;
+    unsigned threadCount;
+
+    // Name of the vector path compiled in
+    static const char* simdName();
+
+private:
+    // light positions and radii as structure of arrays, padded to the SIMD width
+    std::vector<float> lightX, lightY, lightZ, lightRadius;
+    std::vector<std::vector<uint32_t>> tileLights;
+
+    // bounding sphere test on the SoA copy, then the tight test of the spot and capsule lights
+    void cullTile(int tileX, int tileY, const std::vector<Light>& lights, const glm::mat4& view,
+                  const glm::mat4& viewProjection, glm::vec2 depthBounds, std::vector<uint32_t>& visible) const;
+};
+
+#endif /* LightCulling_hpp */
@@ -0,0 +1,197 @@
+//
+//  LightManager.cpp
+//
+
+#include "LightManager.hpp"
+
+#include <algorithm>
+
+void LightManager::initialize(size_t capacity)
+{
+	release();
+	maxLights = capacity;
+
+	GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	GLsizeiptr size = RING_FRAMES * maxLights * sizeof(Light);
+	glGenBuffers(1, &ringBuffer);
+	glBindBuffer(GL_COPY_READ_BUFFER, ringBuffer);
+	glBufferStorage(GL_COPY_READ_BUFFER, size, 0, flags);
+	mappedRing = (GLubyte*)glMapBufferRange(GL_COPY_READ_BUFFER, 0, size, flags);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+}
+
+void LightManager::release()
+{
+	for (GLsync& fence : fences)
+	{
+		if (fence)
+		{
+			glDeleteSync(fence);
+			fence = 0;
+		}
+	}
+	if (ringBuffer != 0)
+	{
+		glBindBuffer(GL_COPY_READ_BUFFER, ringBuffer);
+		glUnmapBuffer(GL_COPY_READ_BUFFER);
+		glBindBuffer(GL_COPY_READ_BUFFER, 0);
+		glDeleteBuffers(1, &ringBuffer);
+		ringBuffer = 0;
+		mappedRing = nullptr;
+	}
+	clear();
+}
+
+uint32_t LightManager::add(const Light& light)
+{
+	if (lights.size() >= maxLights)
+	{
+		return INVALID_HANDLE;
+	}
+
+	uint32_t handle;
+	if (!freeHandles.empty())
+	{
+		handle = freeHandles.back();
+		freeHandles.pop_back();
+	}
+	else
+	{
+		handle = (uint32_t)handleToIndex.size();
+		handleToIndex.push_back(0);
+	}
+
+	handleToIndex[handle] = (uint32_t)lights.size();
+	indexToHandle.push_back(handle);
+	lights.push_back(light);
+	markDirty(handleToIndex[handle]);
+	return handle;
+}
+
+void LightManager::update(uint32_t handle, const Light& light)
+{
+	lights[handleToIndex[handle]] = light;
+	markDirty(handleToIndex[handle]);
+}
+
+void LightManager::remove(uint32_t handle)
+{
+	uint32_t index = handleToIndex[handle];
+	uint32_t last = (uint32_t)lights.size() - 1;
+
+	// keep the array dense by moving the last light into the hole
+	lights[index] = lights[last];
+	indexToHandle[index] = indexToHandle[last];
+	handleToIndex[indexToHandle[index]] = index;
+
+	lights.pop_back();
+	indexToHandle.pop_back();
+	freeHandles.push_back(handle);
+	dirty = true;
+	if (index < last)
+	{
+		markDirty(index);
+	}
+}
+
+void LightManager::clear()
+{
+	lights.clear();
+	handleToIndex.clear();
+	indexToHandle.clear();
+	freeHandles.clear();
+	dirtyIndices.clear();
+	dirtyFlags.clear();
+	dirty = true;
+}
+
+void LightManager::markDirty(uint32_t index)
+{
+	if (index >= dirtyFlags.size())
+	{
+		dirtyFlags.resize(maxLights, false);
+	}
+	if (!dirtyFlags[index])
+	{
+		dirtyFlags[index] = true;
+		dirtyIndices.push_back(index);
+	}
+	dirty = true;
+}
+
+bool LightManager::upload(GLuint positionDestination, GLuint colorDestination, GLuint shapeDestination)
+{
+	if (!dirty || mappedRing == nullptr)
+	{
+		return false;
+	}
+
+	// wait until the copy that last read this section has executed, normally long done
+	section = (section + 1) % RING_FRAMES;
+	if (fences[section])
+	{
+		while (glClientWaitSync(fences[section], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+		{
+		}
+		glDeleteSync(fences[section]);
+		fences[section] = 0;
+	}
+
+	// coalesce the edited lights, removals may have left indices past the end
+	std::sort(dirtyIndices.begin(), dirtyIndices.end());
+	ranges.clear();
+	for (uint32_t index : dirtyIndices)
+	{
+		dirtyFlags[index] = false;
+		if (index >= lights.size())
+		{
+			continue;
+		}
+		if (!ranges.empty() && index <= ranges.back().second + MERGE_GAP)
+		{
+			ranges.back().second = index + 1;
+		}
+		else
+		{
+			ranges.push_back(std::make_pair(index, index + 1));
+		}
+	}
+	dirtyIndices.clear();
+
+	// the mapping is coherent, the copies below see these writes without a flush
+	size_t positionOffset = section * maxLights * sizeof(Light);
+	size_t colorOffset = positionOffset + maxLights * sizeof(glm::vec4);
+	size_t shapeOffset = colorOffset + maxLights * sizeof(glm::uvec2);
+	glm::vec4* positions = (glm::vec4*)(mappedRing + positionOffset);
+	glm::uvec2* colors = (glm::uvec2*)(mappedRing + colorOffset);
+	glm::vec4* shapes = (glm::vec4*)(mappedRing + shapeOffset);
+
+	glBindBuffer(GL_COPY_READ_BUFFER, ringBuffer);
+	for (const auto& range : ranges)
+	{
+		for (uint32_t i = range.first; i < range.second; ++i)
+		{
+			positions[i] = lights[i].positionAndRadius;
+			colors[i] = lights[i].color;
+			shapes[i] = lights[i].shape;
+		}
+
+		// same offsets in the ring section and the destinations
+		GLsizeiptr count = range.second - range.first;
+		glBindBuffer(GL_COPY_WRITE_BUFFER, positionDestination);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, positionOffset + range.first * sizeof(glm::vec4),
+			range.first * sizeof(glm::vec4), count * sizeof(glm::vec4));
+		glBindBuffer(GL_COPY_WRITE_BUFFER, colorDestination);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, colorOffset + range.first * sizeof(glm::uvec2),
+			range.first * sizeof(glm::uvec2), count * sizeof(glm::uvec2));
+		glBindBuffer(GL_COPY_WRITE_BUFFER, shapeDestination);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, shapeOffset + range.first * sizeof(glm::vec4),
+			range.first * sizeof(glm::vec4), count * sizeof(glm::vec4));
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	fences[section] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	dirty = false;
+	return true;
+}
@@ -0,0 +1,81 @@
+//
+//  LightManager.hpp
+//
+//  CPU side owner of the scene lights. Edits are streamed to the GPU through a
+//  persistently mapped ring of RING_FRAMES sections, each guarded by a fence,
+//  so updating every light every frame never waits on the GPU implicitly.
+//  The ring splits the lights into the three GPU streams of Light. Only the
+//  lights edited since the last upload are written and copied, coalesced
+//  into ranges, so a few moving lights among many static ones stay cheap.
+//
+
+#ifndef LightManager_hpp
+#define LightManager_hpp
+
+#ifdef __APPLE__
+#define GL_SILENCE_DEPRECATION
+#include <OpenGL/gl3.h>
+#else
+#include <GL/glew.h>
+#endif
+
+#include <utility>
+#include <vector>
+
+#include "LightCulling.hpp"
+
+class LightManager
+{
+public:
+    // sections in the ring, one per frame the GPU may still be reading
+    static const int RING_FRAMES = 3;
+    static const uint32_t INVALID_HANDLE = 0xFFFFFFFF;
+    // dirty ranges closer than this many lights are merged into one copy
+    static const uint32_t MERGE_GAP = 8;
+    // [first, last) light ranges
+    typedef std::vector<std::pair<uint32_t, uint32_t>> Ranges;
+
+    void initialize(size_t capacity);
+    void release();
+
+    // Handles stay valid until removed, the light order on the GPU may change
+    uint32_t add(const Light& light);
+    void update(uint32_t handle, const Light& light);
+    void remove(uint32_t handle);
+    void clear();
+
+    // Writes the dirty ranges into the next ring section once the GPU is done with it
+    // and copies them into the position/radius, color and shape buffers.
+    // Returns false if nothing changed.
+    bool upload(GLuint positionDestination, GLuint colorDestination, GLuint shapeDestination);
+    // ranges copied by the last upload
+    const Ranges& uploadedRanges() const { return ranges; }
+
+    size_t count() const { return lights.size(); }
+    size_t capacity() const { return maxLights; }
+    const std::vector<Light>& data() const { return lights; }
+
+private:
+    GLuint ringBuffer = 0;
+    // every section holds maxLights positions, maxLights colors and maxLights shapes
+    GLubyte* mappedRing = nullptr;
+    GLsync fences[RING_FRAMES] = {};
+    int section = 0;
+    size_t maxLights = 0;
+    // the count changed, which the ranges do not show for removals
+    bool dirty = false;
+
+    // edited light indices since the last upload, flagged to keep them unique
+    void markDirty(uint32_t index);
+    std::vector<uint32_t> dirtyIndices;
+    std::vector<bool> dirtyFlags;
+    Ranges ranges;
+
+    // dense light array with a handle indirection, removal swaps in the last light
+    std::vector<Light> lights;
+    std::vector<uint32_t> handleToIndex;
+    std::vector<uint32_t> indexToHandle;
+    std::vector<uint32_t> freeHandles;
+};
+
+#endif /* LightManager_hpp */
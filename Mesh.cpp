@@ -8,90 +8,10 @@
 
 #include "Mesh.hpp"
 
-Mesh::Mesh(vector<Vertex> vertices, vector<GLuint> indices, vector<Texture> textures)
+Mesh::Mesh(vector<Vertex> vertices, vector<GLuint> indices, vector<Texture> textures, GLuint materialIndex)
 {
     this->vertices = vertices;
     this->indices = indices;
     this->textures = textures;
-    
-    setupMesh();
-}
-
-void Mesh::setupMesh()
-{
-    // Create buffers and arrays
-    glGenVertexArrays(1, &VAO);
-    glGenBuffers(1, &VBO);
-    glGenBuffers(1, &EBO);
-
-    glBindVertexArray(VAO);
-    // Load data into vertex buffers
-    glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
-
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
-
-    // Set the vertex attribute pointers
-    // Positions
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
-
-    // Normals
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, normal));
-
-    // Texture Coords
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, textureCoord));
-
-    // Tangent
-    glEnableVertexAttribArray(3);
-    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, tangent));
-
-    // Bitangent
-    glEnableVertexAttribArray(4);
-    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, bitangent));
-
-    glBindVertexArray(0);
-}
-
-void Mesh::draw(Program &shader)
-{
-    GLuint diffuseNumber = 1;
-    GLuint specularNumber = 1;
-    GLuint normalNumber = 1;
-    GLuint heightNumber = 1;
-    
-    for(GLuint i = 0; i < textures.size(); ++i)
-    {
-        glActiveTexture(GL_TEXTURE0 + i);
-        stringstream stream;
-        string number;
-        string name = textures[i].type;
-        
-        if(name == "texture_diffuse")
-            stream << diffuseNumber++;
-        else if(name == "texture_specular")
-            stream << specularNumber++;
-        else if(name == "texture_normal")
-            stream << normalNumber++;
-        else if(name == "texture_height")
-            stream << heightNumber++;
-        
-        number = stream.str();
-        
-        glUniform1i(glGetUniformLocation(shader.id, (name + number).c_str()), i);
-        glBindTexture(GL_TEXTURE_2D, textures[i].id);
-    }
-    // draw
-    glBindVertexArray(VAO);
-    glDrawElements(GL_TRIANGLES, (GLsizei)indices.size(), GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0);
-    
-    for(GLuint i = 0; i < textures.size(); ++i)
-    {
-        glActiveTexture(GL_TEXTURE0 + i);
-        glBindTexture(GL_TEXTURE_2D, 0);
-    }
+    this->materialIndex = materialIndex;
 }
@@ -43,22 +43,20 @@ struct Texture {
     GLuint id;
     string type;
     aiString path;
+    // where the material system keeps it, the two halves of a bindless handle or the texture array and layer
+    uvec2 location;
 };
 
+// CPU side geometry of one mesh, Model packs every mesh into its shared buffers
 class Mesh {
 public:
     vector<Vertex> vertices;
     vector<GLuint> indices;
     vector<Texture> textures;
-    GLuint VAO;
+    // material of the source scene, meshes sharing it are drawn in one batch
+    GLuint materialIndex;
     
-    Mesh(vector<Vertex> vertices, vector<GLuint> indices, vector<Texture> textures);
-    
-    void draw(Program &shader);
-private:
-    GLuint VBO, EBO;
-    
-    void setupMesh();
+    Mesh(vector<Vertex> vertices, vector<GLuint> indices, vector<Texture> textures, GLuint materialIndex);
 };
 
 #endif /* Mesh_hpp */
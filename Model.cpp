@@ -12,10 +12,48 @@
 #include "stb_image.h"
 
 
-void Model::draw(Program shader)
+#include <algorithm>
+#include <numeric>
+
+void Model::draw(Program shader, GLuint commands, GLuint drawCount)
 {
-    for(auto& mesh: meshes)
-        mesh.draw(shader);
+    // the material textures stay bound for the whole draw
+    GLint units[MAX_TEXTURE_ARRAYS];
+    for(GLuint i = 0; i < textureArrays.size(); ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrays[i]);
+    }
+    for(GLint i = 0; i < MAX_TEXTURE_ARRAYS; ++i)
+        units[i] = i;
+    glUniform1iv(glGetUniformLocation(shader.id, "textureArrays"), MAX_TEXTURE_ARRAYS, units);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_BINDING, materialBuffer);
+    
+    // draw
+    glBindVertexArray(VAO);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commands != 0 ? commands : commandBuffer);
+#ifndef __APPLE__
+    if(drawCount != 0 && IndirectDrawCountSupported())
+    {
+        // at most commandCount draws, the GPU decides how many
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, drawCount);
+        glMultiDrawElementsIndirectCountARB(GL_TRIANGLES, GL_UNSIGNED_INT, 0, 0, commandCount, 0);
+        glBindBuffer(GL_PARAMETER_BUFFER_ARB, 0);
+    }
+    else
+#endif
+    {
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, 0, commandCount, 0);
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, MATERIAL_BINDING, 0);
+    for(GLuint i = 0; i < textureArrays.size(); ++i)
+    {
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
 }
 
 void Model::LoadModel(string path)
@@ -31,6 +69,103 @@ void Model::LoadModel(string path)
     
     directory = path.substr(0, path.find_last_of(R"(\)"));
     ProcessNode(scene->mRootNode, scene);
+    SetupGeometry();
+    SetupMaterials();
+}
+
+void Model::SetupGeometry()
+{
+    vector<Vertex> vertices;
+    vector<GLuint> indices;
+    vector<DrawElementsIndirectCommand> commands;
+    vector<MeshBounds> bounds;
+    GLuint materialCount = 0;
+    for(const auto& mesh: meshes)
+    {
+        DrawElementsIndirectCommand command;
+        command.count = (GLuint)mesh.indices.size();
+        command.instanceCount = 1;
+        command.firstIndex = (GLuint)indices.size();
+        command.baseVertex = (GLint)vertices.size();
+        command.baseInstance = mesh.materialIndex;
+        materialCount = std::max(materialCount, mesh.materialIndex + 1);
+        
+        // box of the mesh for culling, an empty mesh gets a degenerate box at the origin
+        MeshBounds meshBounds = { vec4(0.0f), vec4(0.0f) };
+        if(!mesh.vertices.empty())
+        {
+            vec3 aabbMin = mesh.vertices[0].position;
+            vec3 aabbMax = aabbMin;
+            for(const auto& vertex: mesh.vertices)
+            {
+                aabbMin = glm::min(aabbMin, vertex.position);
+                aabbMax = glm::max(aabbMax, vertex.position);
+            }
+            meshBounds = { vec4(aabbMin, 1.0f), vec4(aabbMax, 1.0f) };
+        }
+        
+        commands.push_back(command);
+        bounds.push_back(meshBounds);
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+    }
+    commandCount = (GLsizei)commands.size();
+    
+    // Create buffers and arrays
+    glGenVertexArrays(1, &VAO);
+    glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
+    glGenBuffers(1, &commandBuffer);
+    glGenBuffers(1, &boundsBuffer);
+    glGenBuffers(1, &materialIdBuffer);
+    
+    glBindVertexArray(VAO);
+    // Load data into vertex buffers
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STATIC_DRAW);
+    
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLuint), indices.data(), GL_STATIC_DRAW);
+    
+    // Set the vertex attribute pointers
+    // Positions
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)0);
+    
+    // Normals
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, normal));
+    
+    // Texture Coords
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, textureCoord));
+    
+    // Tangent
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, tangent));
+    
+    // Bitangent
+    glEnableVertexAttribArray(4);
+    glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*)offsetof(Vertex, bitangent));
+    
+    // Material, one per draw through the base instance
+    vector<GLuint> materialIds(std::max(materialCount, 1u));
+    iota(materialIds.begin(), materialIds.end(), 0);
+    glBindBuffer(GL_ARRAY_BUFFER, materialIdBuffer);
+    glBufferData(GL_ARRAY_BUFFER, materialIds.size() * sizeof(GLuint), materialIds.data(), GL_STATIC_DRAW);
+    glEnableVertexAttribArray(5);
+    glVertexAttribIPointer(5, 1, GL_UNSIGNED_INT, sizeof(GLuint), (GLvoid*)0);
+    glVertexAttribDivisor(5, 1);
+    
+    glBindVertexArray(0);
+    
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, boundsBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, bounds.size() * sizeof(MeshBounds), bounds.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
 void Model::ProcessNode(aiNode *node, const aiScene *scene)
@@ -111,12 +246,10 @@ Mesh Model::ProcessMesh(aiMesh *mesh, const aiScene *scene)
     // Process Materials
     if (mesh->mMaterialIndex >= 0) {
         aiMaterial* material = scene->mMaterials[mesh->mMaterialIndex];
-        // Sssume a convention for sampler names in the shaders. Each diffuse texture should be named
-        // as 'texture_diffuseN' where N is a sequential number ranging from 1 to MAX_SAMPLER_NUMBER.
-        // Same applies to other texture as the following list summarizes:
-        // Diffuse: texture_diffuseN
-        // Specular: texture_specularN
-        // Normal: texture_normalN
+        // The first texture of every type fills the matching slot of MaterialTextures:
+        // Diffuse: texture_diffuse
+        // Specular: texture_specular
+        // Normal: texture_normal
 
         // Diffuse maps
         vector<Texture> diffuseMaps = LoadMaterialTextures(material, aiTextureType_DIFFUSE, "texture_diffuse");
@@ -129,13 +262,158 @@ Mesh Model::ProcessMesh(aiMesh *mesh, const aiScene *scene)
         // Normal maps
         vector<Texture> normalMaps = LoadMaterialTextures(material, aiTextureType_HEIGHT, "texture_normal");
         textures.insert(textures.end(), normalMaps.begin(), normalMaps.end());
-
-        // Height maps
-        vector<Texture> heightMaps = LoadMaterialTextures(material, aiTextureType_AMBIENT, "texture_height");
-        textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
     }
 
-    return Mesh(vertices, indices, textures);
+    return Mesh(vertices, indices, textures, mesh->mMaterialIndex);
+}
+
+void Model::SetupMaterials()
+{
+    bindlessTextures = BindlessTexturesSupported();
+    
+    // 1x1 stand ins for missing slots, white and a flat normal
+    const GLubyte defaultPixels[2][4] = { { 255, 255, 255, 255 }, { 128, 128, 255, 255 } };
+    uvec2 defaultLocations[2];
+    
+    if(bindlessTextures)
+    {
+#ifndef __APPLE__
+        // one texture per file, sampled through resident handles
+        auto makeResident = [](GLuint id)
+        {
+            GLuint64 handle = glGetTextureHandleARB(id);
+            glMakeTextureHandleResidentARB(handle);
+            return uvec2(GLuint(handle), GLuint(handle >> 32));
+        };
+        for(int i = 0; i < 2; ++i)
+        {
+            GLuint id;
+            glGenTextures(1, &id);
+            glBindTexture(GL_TEXTURE_2D, id);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, defaultPixels[i]);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            defaultLocations[i] = makeResident(id);
+        }
+        for(auto& texture: texturesLoaded)
+        {
+            GLint id = TextureFromFile(texture.path.C_Str(), directory);
+            // a file that failed to load samples white, like the texture array path
+            if(id < 0)
+            {
+                texture.location = defaultLocations[0];
+                continue;
+            }
+            texture.id = GLuint(id);
+            texture.location = makeResident(texture.id);
+        }
+#endif
+    }
+    else
+    {
+        // one array per texture size, the stand ins get their own 1x1 array
+        vector<ivec2> sizes(1, ivec2(1, 1));
+        vector<GLsizei> layers(1, 2);
+        defaultLocations[0] = uvec2(0, 0);
+        defaultLocations[1] = uvec2(0, 1);
+        for(auto& texture: texturesLoaded)
+        {
+            string filename = directory + '\\' + texture.path.C_Str();
+            ivec2 size(0);
+            int channels;
+            if(!stbi_info(filename.c_str(), &size.x, &size.y, &channels))
+            {
+                cerr << "Texture loaded failure";
+                texture.location = defaultLocations[0];
+                continue;
+            }
+            size_t bucket = find(sizes.begin(), sizes.end(), size) - sizes.begin();
+            if(bucket == sizes.size())
+            {
+                if(sizes.size() == MAX_TEXTURE_ARRAYS)
+                {
+                    cerr << "More than " << MAX_TEXTURE_ARRAYS << " texture sizes, " << texture.path.C_Str() << " is left out" << endl;
+                    texture.location = defaultLocations[0];
+                    continue;
+                }
+                sizes.push_back(size);
+                layers.push_back(0);
+            }
+            texture.location = uvec2(GLuint(bucket), GLuint(layers[bucket]++));
+        }
+        
+        textureArrays.resize(sizes.size());
+        glGenTextures((GLsizei)textureArrays.size(), textureArrays.data());
+        for(size_t i = 0; i < sizes.size(); ++i)
+        {
+            GLsizei levels = 1;
+            while((std::max(sizes[i].x, sizes[i].y) >> levels) > 0)
+                ++levels;
+            glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrays[i]);
+            glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, sizes[i].x, sizes[i].y, layers[i]);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        }
+        
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrays[0]);
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, 1, 1, 2, GL_RGBA, GL_UNSIGNED_BYTE, defaultPixels);
+        // decoded one at a time as RGBA into its layer
+        for(const auto& texture: texturesLoaded)
+        {
+            if(texture.location == defaultLocations[0])
+                continue;
+            string filename = directory + '\\' + texture.path.C_Str();
+            ivec2 size = sizes[texture.location.x];
+            int channels;
+            unsigned char* data = stbi_load(filename.c_str(), &size.x, &size.y, &channels, 4);
+            if(data)
+            {
+                glBindTexture(GL_TEXTURE_2D_ARRAY, textureArrays[texture.location.x]);
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, texture.location.y, size.x, size.y, 1, GL_RGBA, GL_UNSIGNED_BYTE, data);
+            }
+            else
+            {
+                cerr << "Texture loaded failure";
+            }
+            stbi_image_free(data);
+        }
+        for(GLuint textureArray: textureArrays)
+        {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, textureArray);
+            glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        }
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    }
+    
+    // the first texture of each slot, the stand ins where a material has none
+    GLuint materialCount = 0;
+    for(const auto& mesh: meshes)
+        materialCount = std::max(materialCount, mesh.materialIndex + 1);
+    vector<MaterialTextures> materials(std::max(materialCount, 1u),
+        MaterialTextures{ defaultLocations[0], defaultLocations[0], defaultLocations[1] });
+    for(const auto& mesh: meshes)
+    {
+        MaterialTextures& material = materials[mesh.materialIndex];
+        for(auto it = mesh.textures.rbegin(); it != mesh.textures.rend(); ++it)
+        {
+            // the deduplicated copy holds the location
+            auto loaded = find_if(texturesLoaded.begin(), texturesLoaded.end(), [&](const Texture& texture) { return texture.path == it->path; });
+            if(it->type == "texture_diffuse")
+                material.diffuse = loaded->location;
+            else if(it->type == "texture_specular")
+                material.specular = loaded->location;
+            else if(it->type == "texture_normal")
+                material.normal = loaded->location;
+        }
+    }
+    
+    glGenBuffers(1, &materialBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, materialBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, materials.size() * sizeof(MaterialTextures), materials.data(), GL_STATIC_DRAW);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 }
 
 vector<Texture> Model::LoadMaterialTextures(aiMaterial *mat, aiTextureType type, string typeName)
@@ -160,8 +438,10 @@ vector<Texture> Model::LoadMaterialTextures(aiMaterial *mat, aiTextureType type,
         }
         if(!skip)
         {
+            // created by SetupMaterials once every texture is known
             Texture texture;
-            texture.id = TextureFromFile(str.C_Str(), directory);
+            texture.id = 0;
+            texture.location = uvec2(0);
             texture.type = typeName;
             texture.path = str;
             textures.push_back(texture);
@@ -171,6 +451,24 @@ vector<Texture> Model::LoadMaterialTextures(aiMaterial *mat, aiTextureType type,
     return textures;
 }
 
+bool BindlessTexturesSupported()
+{
+#ifdef __APPLE__
+    return false;
+#else
+    return GLEW_ARB_bindless_texture != 0;
+#endif
+}
+
+bool IndirectDrawCountSupported()
+{
+#ifdef __APPLE__
+    return false;
+#else
+    return GLEW_ARB_indirect_parameters != 0;
+#endif
+}
+
 GLint TextureFromFile(const char* path, string directory, bool gamma)
 {
     string filename = string(path);
@@ -211,6 +509,7 @@ GLint TextureFromFile(const char* path, string directory, bool gamma)
     }
     cerr << "Texture loaded failure";
     stbi_image_free(data);
+    glDeleteTextures(1, &textureID);
     return -1;
     
 }
@@ -23,12 +23,54 @@ using namespace std;
 
 GLint TextureFromFile(const char* path, string directory, bool gamma = false);
 
+// Whether the driver samples through bindless texture handles, otherwise the materials use texture arrays
+bool BindlessTexturesSupported();
+
+// Whether the driver reads the draw count of a multi-draw call from a buffer, otherwise every command is
+// submitted and the unused ones must have no instances
+bool IndirectDrawCountSupported();
+
+// arguments of one draw of glMultiDrawElementsIndirect, the layout is fixed by GL
+struct DrawElementsIndirectCommand {
+    GLuint count;
+    GLuint instanceCount;
+    GLuint firstIndex;
+    GLint baseVertex;
+    GLuint baseInstance;
+};
+
+// model space box of a mesh, entry i belongs to draw command i, must match mesh_culling_comp.glsl
+struct MeshBounds {
+    vec4 aabbMin;
+    vec4 aabbMax;
+};
+
+// texture location of every slot of a material, see Texture, must match final_shading_frag.glsl
+struct MaterialTextures {
+    uvec2 diffuse;
+    uvec2 specular;
+    uvec2 normal;
+};
+
 class Model{
 public:
     vector<Texture> texturesLoaded;
     vector<Mesh> meshes;
     string directory;
     bool gammaCorrection;
+    // every mesh packed into one vertex and index buffer behind a single VAO, with one indirect
+    // draw command per mesh, its base instance is the material of the mesh
+    GLuint VAO = 0;
+    GLuint commandBuffer = 0;
+    GLsizei commandCount = 0;
+    // MeshBounds of every draw command, for culling the draws on the GPU
+    GLuint boundsBuffer = 0;
+    // texture arrays of the texture sizes in the model, bound to the first units, must match final_shading_frag.glsl
+    static const int MAX_TEXTURE_ARRAYS = 8;
+    // shader storage binding of the MaterialTextures of every material
+    static const GLuint MATERIAL_BINDING = 30;
+    bool bindlessTextures = false;
+    vector<GLuint> textureArrays;
     
     // Takes a file path to 3D model
     Model() {}
@@ -37,10 +79,23 @@ public:
         LoadModel(path);
     }
     
-    void draw(Program shader);
+    // Every mesh in one multi-draw call, the shader looks up the textures of the material of every draw.
+    // A non-zero commands replaces commandBuffer, e.g. with the draws left by mesh culling, and drawCount
+    // holds how many of its commands to draw when the driver can read the count from a buffer
+    void draw(Program shader, GLuint commands = 0, GLuint drawCount = 0);
 private:
+    GLuint VBO = 0, EBO = 0;
+    GLuint materialBuffer = 0;
+    // per instance material attribute, entry i is i so the base instance selects it
+    GLuint materialIdBuffer = 0;
+
     void LoadModel(string path);
     
+    // Packs the meshes into the shared buffers and records their draw commands and bounds
+    void SetupGeometry();
+    // Loads the textures into bindless textures or texture arrays and fills the material buffer
+    void SetupMaterials();
+    
     void ProcessNode(aiNode* node, const aiScene* scene);
     
     Mesh ProcessMesh(aiMesh* mesh, const aiScene* scene);
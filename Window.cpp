@@ -1,7 +1,13 @@
 #include "Window.h"
+#include "LightCulling.hpp"
+#include "LightManager.hpp"
 #include <vector>
 #include <numeric>
 #include <typeinfo>
+#include <algorithm>
+#include <bitset>
+#include <chrono>
+#include <iterator>
 
 /* 
  * Declare your variables below. Unnamed namespace is used here to avoid 
@@ -26,25 +32,190 @@ namespace
 
     GLuint depthMapFBO;
     GLuint depthMap;
+    // target of the final pass, a color texture on the prepass depth map so every pixel is shaded once,
+    // then copied to the window
+    GLuint shadingFBO;
+    GLuint shadingColor;
+    // linear min/max depth per tile, one texel per tile
+    GLuint tileDepthBounds = 0;
+    // 32 bin depth occupancy per tile
+    GLuint tileDepthMask = 0;
 
     Model sponzaModel;
+    // GPU culling of the model meshes, toggled with O. Every prepass first culls the meshes against the
+    // frustum and the depth pyramid of the previous prepass, both passes draw the commands left
+    bool meshCulling = true;
+    GLuint visibleCommandBuffer = 0;
+    GLuint drawCountBuffer = 0;
+    // min/max depth of the last prepass per 2x2, 4x4, ... pixels, sized for the next powers of two of
+    // the screen so texel x of level n covers pixels [x, x + 1) * 2^(n + 1). Built after every prepass, the
+    // level of the tile size gives the tile depth bounds and the farthest depth is the occluder of mesh culling
+    GLuint depthPyramid = 0;
+    glm::ivec2 depthPyramidSize;
+    int depthPyramidLevels = 0;
+    // the pyramid holds a prepass of the current scene
+    bool depthPyramidValid = false;
 
     // tile property
+    // tile side in pixels (8, 16 or 32), injected into the shaders as a define
+    int tileSize = 16;
+    // shared memory bound of the tile and super tile light lists, the lists hold min(NUM_LIGHTS, this)
+    const int MAX_SHARED_LIGHTS = 4096;
+    // time every tile size at startup and keep the fastest
+    bool autoTuneTileSize = true;
     // X and Y work group dimension variables for compute shader
     GLuint workGroupsX = 0;
     GLuint workGroupsY = 0;
+    // 64x64 pixel super tiles of the coarse culling pass, SuperTileTiles() tiles per side
+    const int SUPER_TILE_SIZE = 64;
+    GLuint superTilesX = 0;
+    GLuint superTilesY = 0;
 
     // Used for storage buffer objects to hold light data and visible light indicies data
     GLuint lightBuffer = 0;
+    // written by the light animation pass, then swapped with lightBuffer
+    GLuint animatedLightBuffer = 0;
+    // packed light colors, lightBuffer only holds position and radius for the culling passes
+    GLuint lightColorBuffer = 0;
+    // light type and the cone or capsule of spot and capsule lights
+    GLuint lightShapeBuffer = 0;
+    // view space lights inside the camera frustum, compacted every frame by the transform pass and
+    // read by culling and shading, with the index of the source light and their count
+    GLuint viewLightBuffer = 0;
+    GLuint viewLightColorBuffer = 0;
+    GLuint viewLightShapeBuffer = 0;
+    GLuint viewLightSourceBuffer = 0;
+    GLuint viewLightCountBuffer = 0;
     GLuint visibleLightIndicesBuffer = 0;
+    // per tile or cluster (offset, count) into visibleLightIndicesBuffer and its allocator
+    GLuint lightGridBuffer = 0;
+    GLuint lightIndexCounterBuffer = 0;
+    // size of the index pool in uints
+    GLuint indexPoolSize = 0;
+    // store two 16 bit light indices per uint when every light index fits
+    bool packedLightIndices = false;
+
+    // culling mode, toggled with C
+    CullingMode cullingMode = CullingMode::Tiled;
+    // light vs tile test of the tiled mode, toggled with T, injected into the shaders as a define
+    LightTileTest lightTileTest = LightTileTest::Plane;
+    // cluster property, must match cluster_culling_comp.glsl and final_shading_frag.glsl
+    const int CLUSTER_SLICES = 16;
+    // shared memory bound of a cluster light list, the 16 lists of a tile hold min(NUM_LIGHTS, this) each
+    const int MAX_LIGHTS_PER_CLUSTER = 128;
+    // expected occupancy used to size the shared index pool
+    const int AVERAGE_LIGHTS_PER_CLUSTER = 16;
+
+    // candidate lights per super tile from the coarse pass
+    GLuint coarseLightGridBuffer = 0;
+    GLuint coarseLightIndicesBuffer = 0;
+    // depth sorted copy of the lights, per tile light bitmask and depth bins of the Z-binned mode
+    GLuint sortedLightBuffer = 0;
+    GLuint sortedLightColorBuffer = 0;
+    GLuint sortedLightShapeBuffer = 0;
+    // scene light index of every sorted light, keeps the importance fade attached to its light
+    GLuint sortedLightSourceBuffer = 0;
+    GLuint tileLightMaskBuffer = 0;
+    GLuint zBinBuffer = 0;
+    // linear BVH of the BVH mode, rebuilt from the view lights every frame. Morton codes and view light
+    // indices ping-pong between the two halves of the radix sort, the sorted light copies above then
+    // hold the view lights in Morton order. The Z-binned mode sorts its depth keys in the same buffers
+    GLuint mortonKeyBuffers[2] = {};
+    GLuint mortonValueBuffers[2] = {};
+    GLuint radixHistogramBuffer = 0;
+    GLuint bvhNodeBuffer = 0;
+    GLuint bvhParentBuffer = 0;
+    GLuint bvhVisitBuffer = 0;
+    // 32 bit keys sorted 4 bits per pass, an even count leaves them in the first half
+    const int RADIX_PASSES = 8;
+    const int RADIX_BITS = 4;
+    // must match the GROUP_SIZE of radix_sort_comp.glsl
+    const int RADIX_BLOCK = 256;
+    // must match final_shading_frag.glsl
+    const int Z_BINS = 64;
+    // uints per tile in the tile light mask
+    GLuint lightWords = 0;
+    // two level culling, toggled with H
+    bool hierarchicalCulling = false;
+
+    // 2.5D depth mask culling in the tiled mode, toggled with M
+    bool depthMaskCulling = false;
+    // debug counters written by the culling and final pass
+    GLuint cullingStatsBuffer = 0;
+    // collect light loop statistics for the next frame, requested with F
+    bool captureLightStats = false;
 
 	// lights
+	// capacity of the light buffers
 	int NUM_LIGHTS = 1024;
+	// lights in the scene, at most NUM_LIGHTS
+	int lightCount = 0;
+	// owns the lights and streams CPU side edits to lightBuffer
+	LightManager lightManager;
 	// Constants for light animations
 	const glm::vec3 LIGHT_MIN_BOUNDS = glm::vec3(-135.0f, -20.0f, -60.0f);
 	const glm::vec3 LIGHT_MAX_BOUNDS = glm::vec3(135.0f, 170.0f, 60.0f);
 	const float LIGHT_DELTA_TIME = -0.6f;
 	const float LIGHT_RADIUS = 30.0f;
+	// share of spot and capsule lights in the scene, the rest are point lights
+	const float SPOT_LIGHT_FRACTION = 0.3f;
+	const float CAPSULE_LIGHT_FRACTION = 0.2f;
+	// move the lights on the GPU every frame, toggled with L
+	bool animateLights = true;
+	// sceneLights matches the GPU copy up to this light, the animation moves the ones from FirstDynamicLight()
+	int currentSceneLights = 0;
+	// the light lists of the last culled frame are reused while the view, the lights and the
+	// culling settings stay the same, most frames of a static camera skip the prepass and culling
+	bool cullingValid = false;
+	glm::mat4 culledView;
+
+	// importance LOD, toggled with I. Lights whose projected radius in pixels times intensity stays
+	// below lodThreshold fade out, the threshold follows the GPU frame time towards frameBudget
+	bool lightLod = false;
+	// frame time in milliseconds, changed with + and -
+	float frameBudget = 8.0f;
+	float lodThreshold = 0.0f;
+	// smallest non-zero threshold and the change per frame of the controller
+	const float LOD_MIN_THRESHOLD = 0.5f;
+	const float LOD_THRESHOLD_STEP = 1.05f;
+	// seconds for a light to fade fully in or out
+	const float LOD_FADE_TIME = 0.3f;
+	// per light fade kept on the GPU across frames
+	GLuint lightFadeBuffer = 0;
+
+	// world space grid over the static lights, toggled with G. All but the last DYNAMIC_LIGHTS lights stay
+	// in place and the transform pass gathers them from the grid cells in the frustum instead of testing
+	// every one, the dynamic lights are still animated and tested one by one
+	bool staticLightGrid = false;
+	const int DYNAMIC_LIGHTS = 64;
+	StaticLightGrid lightGrid;
+	GLuint staticLightGridBuffer = 0;
+	GLuint staticLightIndicesBuffer = 0;
+	// frame stamp of the last gather per light, a light in several visible cells is transformed once
+	GLuint lightStampBuffer = 0;
+	GLuint frameStamp = 0;
+	// while the grid is on the dynamic lights are transformed and culled into their own per tile lists every
+	// frame they move, the lists of the static lights are kept as long as the view and the static lights stay
+	GLuint dynamicViewLightBuffer = 0;
+	GLuint dynamicViewLightColorBuffer = 0;
+	GLuint dynamicViewLightShapeBuffer = 0;
+	GLuint dynamicViewLightSourceBuffer = 0;
+	GLuint dynamicViewLightCountBuffer = 0;
+	GLuint dynamicLightIndicesBuffer = 0;
+	GLuint dynamicLightGridBuffer = 0;
+	GLuint dynamicLightIndexCounterBuffer = 0;
+	// every tile can hold every dynamic light
+	GLuint dynamicIndexPoolSize = 0;
+	// move the last STREAMED_LIGHTS lights on the CPU and stream them through lightManager every frame,
+	// toggled with K. With the grid on they are dynamic lights and only their lists are culled again
+	bool streamLights = false;
+	const int STREAMED_LIGHTS = 16;
+	// radians per second around the vertical axis through the center of the light bounds
+	const float STREAMED_LIGHT_SPEED = 0.5f;
+	// GPU time of the last frames, read back a frame late so the CPU never waits
+	GLuint frameTimeQueries[2] = {};
+	bool frameTimeQueried[2] = {};
+	int frameTimeQuery = 0;
 
 	// loop property
 	float deltaTime = 0.0f;
@@ -54,23 +225,71 @@ namespace
 	float lastY = 300.0f;
 
 
-	struct PointLight {
-		vec4 color;
-		vec4 position;
-		vec4 paddingAndRadius;
+	// first and last depth sorted light overlapping a depth bin, empty when first > last
+	struct ZBin {
+		GLuint first;
+		GLuint last;
 	};
 
-	struct VisibleIndex {
-		int index;
+	struct CullingStats {
+		GLuint depthMaskRejectedLights;
+		// light loop iterations in the final pass and how many had non-zero attenuation
+		GLuint shadedLights;
+		GLuint contributingLights;
+		// lights dropped because a list was full or the index pool ran out
+		GLuint overflowedLights;
+		GLuint poolOverflowedLights;
 	};
 
+	// GPU timestamps around the passes of a frame, taken when timePasses is set
+	enum PassTimestamp
+	{
+		AnimationStart,
+		AnimationEnd,
+		CullingStart,
+		TransformEnd,
+		BvhEnd,
+		ReductionEnd,
+		CoarseEnd,
+		CullingEnd,
+		ShadingStart,
+		ShadingEnd,
+		PASS_TIMESTAMPS
+	};
+	GLuint passTimestamps[PASS_TIMESTAMPS] = {};
+	bool timePasses = false;
+
 	// program
 	GLuint quadVAO = 0;
 	GLuint quadVBO;
 	Program depthShader;
 	Program depthRenderShader;
+	Program depthReductionShader;
+	Program depthMaskShader;
+	Program coarseCullingShader;
 	Program lightCullingShader;
+	Program clusterCullingShader;
+	Program zBinCullingShader;
+	Program zBinKeyShader;
+	Program zBinGatherShader;
+	Program lightAnimationShader;
+	Program lightTransformShader;
+	Program staticLightTransformShader;
+	Program mortonCodeShader;
+	Program radixHistogramShader;
+	Program radixScanShader;
+	Program radixScatterShader;
+	Program bvhNodeShader;
+	Program bvhBoundsShader;
+	Program bvhCullingShader;
 	Program finalShader;
+	Program depthPyramidShader;
+	Program meshCullingShader;
+
+	// CPU copy of the light buffer
+	vector<Light> sceneLights;
+	// lightManager handle of every light added by SetupLights, in light order
+	vector<uint32_t> lightHandles;
 };
 
 void drawQuad()
@@ -111,7 +330,94 @@ vec3 RandomPosition(uniform_real_distribution<> dis, mt19937 gen)
 	return position;
 }
 
-void SetupLights()
+// Records a GPU timestamp for the pass profiling of the stress test
+void MarkPass(PassTimestamp pass)
+{
+	if (timePasses)
+	{
+		glQueryCounter(passTimestamps[pass], GL_TIMESTAMP);
+	}
+}
+
+// First light the animation and the per light transform handle, the ones before it are static
+// and gathered from the static light grid
+int FirstDynamicLight()
+{
+	return staticLightGrid ? std::max(lightCount - DYNAMIC_LIGHTS, 0) : 0;
+}
+
+// The dynamic lights get their own per tile lists while the static light grid gathers the static ones,
+// the Z-binned mode bins every light together
+bool SplitDynamicLights(CullingMode mode)
+{
+	return staticLightGrid && mode != CullingMode::ZBinned;
+}
+
+void SyncSceneLights(int lights);
+
+// Grids the static lights at their current positions, only read back when they moved since the last grid
+void UpdateStaticLightGrid()
+{
+	SyncSceneLights(FirstDynamicLight());
+	lightGrid.build(sceneLights, FirstDynamicLight());
+
+	// at least one element, empty buffers cannot be bound
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, staticLightGridBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(lightGrid.cells.size(), 1) * sizeof(LightGridCell), lightGrid.cells.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, staticLightIndicesBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(lightGrid.indices.size(), 1) * sizeof(GLuint), lightGrid.indices.data(), GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	// the animation pass only writes the dynamic lights, both of its buffers need the static ones
+	glBindBuffer(GL_COPY_READ_BUFFER, lightBuffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, animatedLightBuffer);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, lightCount * sizeof(vec4));
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	cullingValid = false;
+}
+
+// Streams the lights edited through lightManager since the last frame into lightBuffer,
+// replacing whatever the GPU animation made of them. Returns true if any light changed.
+bool UploadLights()
+{
+	if (!lightManager.upload(lightBuffer, lightColorBuffer, lightShapeBuffer))
+	{
+		return false;
+	}
+
+	// patch the CPU copy with the same ranges, the untouched lights keep their animated positions
+	const vector<Light>& lights = lightManager.data();
+	bool staticLightsChanged = sceneLights.size() != lights.size();
+	if (staticLightsChanged)
+	{
+		// the lights outside the uploaded ranges hold their animated positions on the GPU only
+		sceneLights = lights;
+		const auto& ranges = lightManager.uploadedRanges();
+		currentSceneLights = ranges.empty() || ranges[0].first != 0 ? 0 : int(ranges[0].second);
+	}
+	else
+	{
+		for (const auto& range : lightManager.uploadedRanges())
+		{
+			std::copy(lights.begin() + range.first, lights.begin() + range.second, sceneLights.begin() + range.first);
+		}
+	}
+	lightCount = int(sceneLights.size());
+
+	// regrid when a static light was edited, before the next animation or culling pass reads the grid
+	for (const auto& range : lightManager.uploadedRanges())
+	{
+		staticLightsChanged = staticLightsChanged || int(range.first) < FirstDynamicLight();
+	}
+	if (staticLightGrid && staticLightsChanged)
+	{
+		UpdateStaticLightGrid();
+	}
+	return true;
+}
+
+void SetupLights(float radius = LIGHT_RADIUS)
 {
 	if (lightBuffer == 0)
 	{
@@ -121,27 +427,1247 @@ void SetupLights()
 	mt19937 gen(rd());
 	uniform_real_distribution<> dis(0, 1);
 
+	lightManager.clear();
+	lightHandles.clear();
+	for (int i = 0; i < NUM_LIGHTS; ++i)
+	{
+		vec3 position = RandomPosition(dis, gen);
+		vec4 color = vec4(1.0f + dis(gen), 1.0f + dis(gen), 1.0f + dis(gen), 1.0f);
+		float type = (float)dis(gen);
+		if (type < SPOT_LIGHT_FRACTION)
+		{
+			// spots pointing roughly down
+			vec3 direction = vec3(dis(gen) - 0.5, -1.0, dis(gen) - 0.5);
+			lightHandles.push_back(lightManager.add(MakeSpotLight(position, direction, radius, radians(20.0f + 25.0f * (float)dis(gen)), color)));
+		}
+		else if (type < SPOT_LIGHT_FRACTION + CAPSULE_LIGHT_FRACTION)
+		{
+			// horizontal tubes, bounded by the same radius as the point lights
+			vec3 halfAxis = vec3(dis(gen) - 0.5, 0.0, dis(gen) - 0.5) * radius;
+			lightHandles.push_back(lightManager.add(MakeCapsuleLight(position, halfAxis, 0.5f * radius, color)));
+		}
+		else
+		{
+			lightHandles.push_back(lightManager.add(MakePointLight(position, radius, color)));
+		}
+	}
+
+	UploadLights();
+}
+
+// Turns the last STREAMED_LIGHTS lights around the center of the light bounds on the CPU and hands them to
+// lightManager, which uploads only their dirty range. Overrides the GPU animation of these lights
+void StreamLights()
+{
+	const vector<Light>& lights = lightManager.data();
+	float cosAngle = std::cos(STREAMED_LIGHT_SPEED * deltaTime);
+	float sinAngle = std::sin(STREAMED_LIGHT_SPEED * deltaTime);
+	auto rotateY = [&](vec3 v) { return vec3(cosAngle * v.x + sinAngle * v.z, v.y, cosAngle * v.z - sinAngle * v.x); };
+	vec3 center = 0.5f * (LIGHT_MIN_BOUNDS + LIGHT_MAX_BOUNDS);
+	size_t first = lightHandles.size() - std::min<size_t>(lightHandles.size(), STREAMED_LIGHTS);
+	for (size_t i = first; i < lightHandles.size(); ++i)
+	{
+		Light light = lights[i];
+		light.positionAndRadius = vec4(center + rotateY(vec3(light.positionAndRadius) - center), light.positionAndRadius.w);
+		// spot directions and capsule segments turn with the light
+		light.shape = vec4(rotateY(vec3(light.shape)), light.shape.w);
+		lightManager.update(lightHandles[i], light);
+	}
+}
+
+// Advances the lights on the GPU into the other light buffer and swaps, culling always reads a complete snapshot
+void UpdateLights()
+{
+	MarkPass(AnimationStart);
+	lightAnimationShader.use();
+	lightAnimationShader.setInt("lightCount", lightCount);
+	lightAnimationShader.setInt("firstLight", FirstDynamicLight());
+	lightAnimationShader.setFloat("lightStep", LIGHT_DELTA_TIME);
+	lightAnimationShader.setVec3("lightMinBounds", LIGHT_MIN_BOUNDS);
+	lightAnimationShader.setVec3("lightMaxBounds", LIGHT_MAX_BOUNDS);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, lightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, animatedLightBuffer);
+	glDispatchCompute((lightCount - FirstDynamicLight() + 255) / 256, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, 0);
+
+	std::swap(lightBuffer, animatedLightBuffer);
+	currentSceneLights = std::min(currentSceneLights, FirstDynamicLight());
+	MarkPass(AnimationEnd);
+}
+
+// Reads the first lights back for the CPU side users, the static light grid and the CPU culler, skipping
+// the ones sceneLights already matches
+void SyncSceneLights(int lights)
+{
+	int first = currentSceneLights;
+	if (first >= lights)
+	{
+		return;
+	}
+	// only positions move, the colors on the CPU are current
+	vector<vec4> positions(lights - first);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer);
-	PointLight* pointLights = (PointLight*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_WRITE);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(vec4), positions.size() * sizeof(vec4), positions.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	for (int i = first; i < lights; ++i)
+	{
+		sceneLights[i].positionAndRadius = positions[i - first];
+	}
+	currentSceneLights = lights;
+}
 
-	for (int i = 0; i < NUM_LIGHTS; ++i)
+const char* CullingModeName(CullingMode mode)
+{
+	switch (mode)
+	{
+		case CullingMode::Clustered:
+			return "clustered";
+		case CullingMode::ZBinned:
+			return "z-binned";
+		case CullingMode::Bvh:
+			return "BVH";
+		default:
+			return "tiled";
+	}
+}
+
+const char* LightTileTestName(LightTileTest test)
+{
+	switch (test)
+	{
+		case LightTileTest::Aabb:
+			return "AABB";
+		case LightTileTest::Cone:
+			return "cone";
+		default:
+			return "plane";
+	}
+}
+
+// Radix sorts the keys in mortonKeyBuffers[0] with their values in mortonValueBuffers[0], stable, 4 bits
+// per pass from the lowest. The key count is read on the GPU from the view light count at binding 14.
+void SortKeys(GLuint groups)
+{
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 26, radixHistogramBuffer);
+	for (int pass = 0; pass < RADIX_PASSES; ++pass)
+	{
+		int source = pass & 1;
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, mortonKeyBuffers[source]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, mortonValueBuffers[source]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 24, mortonKeyBuffers[source ^ 1]);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 25, mortonValueBuffers[source ^ 1]);
+
+		Program* stages[] = { &radixHistogramShader, &radixScanShader, &radixScatterShader };
+		for (Program* stage : stages)
+		{
+			stage->use();
+			stage->setUint("shift", pass * RADIX_BITS);
+			stage->setUint("blockCount", groups);
+			glDispatchCompute(stage == &radixScanShader ? 1 : groups, 1, 1);
+			glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+		}
+	}
+	GLuint sortBindings[] = { 24, 25, 26 };
+	for (GLuint binding : sortBindings)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+}
+
+// Sorts the lights by view depth on the GPU and records the sorted light range touching every depth bin,
+// see zbin_sort_comp.glsl. Also sets the view light count to every light for the passes after it.
+void UpdateZBins()
+{
+	GLuint groups = (lightCount + RADIX_BLOCK - 1) / RADIX_BLOCK;
+	ZBin emptyBin = { 0xFFFFFFFF, 0 };
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, zBinBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_RG32UI, GL_RG_INTEGER, GL_UNSIGNED_INT, &emptyBin);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	if (groups == 0)
+	{
+		return;
+	}
+
+	zBinKeyShader.use();
+	zBinKeyShader.setMat4("view", view);
+	zBinKeyShader.setInt("lightCount", lightCount);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, lightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, viewLightCountBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, mortonKeyBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, mortonValueBuffers[0]);
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	SortKeys(groups);
+
+	zBinGatherShader.use();
+	zBinGatherShader.setMat4("view", view);
+	zBinGatherShader.setInt("lightCount", lightCount);
+	zBinGatherShader.setFloat("near", near);
+	zBinGatherShader.setFloat("far", far);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, zBinBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, lightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, lightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, sortedLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, sortedLightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, sortedLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, sortedLightSourceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, mortonKeyBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, mortonValueBuffers[0]);
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	GLuint gatherBindings[] = { 22, 23 };
+	for (GLuint binding : gatherBindings)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+}
+
+// Binds the view lights and the light lists shared by the culling and the final pass
+void BindLightLists(CullingMode mode)
+{
+	// the BVH leaves refer to the view lights in Morton order
+	bool bvh = mode == CullingMode::Bvh;
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, bvh ? sortedLightBuffer : viewLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, bvh ? sortedLightColorBuffer : viewLightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, bvh ? sortedLightShapeBuffer : viewLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visibleLightIndicesBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, lightGridBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, lightIndexCounterBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, cullingStatsBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, coarseLightGridBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, coarseLightIndicesBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, tileLightMaskBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, zBinBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, viewLightCountBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 27, bvhNodeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 35, dynamicViewLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 36, dynamicViewLightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 37, dynamicViewLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 38, dynamicLightIndicesBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 39, dynamicLightGridBuffer);
+}
+
+// Builds the light BVH over the view lights of the transform pass: Morton codes, a radix sort of them,
+// the internal nodes and finally their bounds from the leaves up, which also copies the view lights
+// into Morton order. Dispatches cover every light, the passes read the view light count on the GPU.
+void BuildLightBvh()
+{
+	GLuint groups = (lightCount + 255) / 256;
+	if (groups == 0)
+	{
+		return;
+	}
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, viewLightCountBuffer);
+
+	// quantize the codes in the view space box of the camera frustum
+	float farX = far / projection[0][0];
+	float farY = far / projection[1][1];
+	mortonCodeShader.use();
+	mortonCodeShader.setVec3("boundsMin", vec3(-farX, -farY, -far));
+	mortonCodeShader.setVec3("boundsMax", vec3(farX, farY, -near));
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, viewLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, mortonKeyBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, mortonValueBuffers[0]);
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	SortKeys(groups);
+
+	// internal nodes from the sorted codes
+	bvhNodeShader.use();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 22, mortonKeyBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 23, mortonValueBuffers[0]);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 27, bvhNodeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 28, bvhParentBuffer);
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// bounds from the leaves up and the lights in Morton order
+	GLuint zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhVisitBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	bvhBoundsShader.use();
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, viewLightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, viewLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, viewLightSourceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 29, bvhVisitBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, sortedLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, sortedLightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, sortedLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, sortedLightSourceBuffer);
+	glDispatchCompute(groups, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	GLuint buildBindings[] = { 11, 12, 13, 16, 18, 22, 23, 28, 29 };
+	for (GLuint binding : buildBindings)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+}
+
+// Uniforms shared by the per light and the static light grid variant of the transform pass
+void SetLightTransformUniforms(const Program& shader, CullingMode mode)
+{
+	shader.setMat4("view", view);
+	shader.setMat4("projection", projection);
+	shader.setInt("lightCount", lightCount);
+	shader.setFloat("near", near);
+	shader.setFloat("far", far);
+	shader.setBool("compactLights", mode != CullingMode::ZBinned);
+	shader.setBool("sortedLights", mode == CullingMode::ZBinned);
+	shader.setInt2("screenSize", SCREEN_SIZE);
+	shader.setFloat("lodThreshold", lightLod ? lodThreshold : 0.0f);
+	shader.setFloat("lodFadeStep", std::min(deltaTime / LOD_FADE_TIME, 1.0f));
+}
+
+// Transforms the dynamic lights and culls them into their own per tile lists with the tiled test, against
+// the tile depth of the last culling pass. Reruns alone when only the dynamic lights moved
+void DispatchDynamicLightCulling(CullingMode mode)
+{
+	GLuint zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicLightIndexCounterBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightCountBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	int firstLight = FirstDynamicLight();
+	lightTransformShader.use();
+	SetLightTransformUniforms(lightTransformShader, mode);
+	lightTransformShader.setInt("firstLight", firstLight);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, lightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, lightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, lightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, dynamicViewLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, dynamicViewLightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, dynamicViewLightSourceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, dynamicViewLightCountBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, dynamicViewLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, lightFadeBuffer);
+
+	glDispatchCompute((lightCount - firstLight + 255) / 256, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	GLuint outputBindings[] = { 11, 12, 13, 16, 17 };
+	for (GLuint binding : outputBindings)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+
+	// the few dynamic lights need no coarse pass, the depth mask is only built for the tiled and BVH modes
+	lightCullingShader.use();
+	lightCullingShader.setMat4("projection", projection);
+	lightCullingShader.setInt2("screenSize", SCREEN_SIZE);
+	lightCullingShader.setUint("indexPoolSize", dynamicIndexPoolSize);
+	lightCullingShader.setBool("packedIndices", false);
+	lightCullingShader.setBool("depthMaskCulling", depthMaskCulling && (mode == CullingMode::Tiled || mode == CullingMode::Bvh));
+	lightCullingShader.setBool("hierarchicalCulling", false);
+
+	glActiveTexture(GL_TEXTURE5);
+	lightCullingShader.setInt("tileDepthBounds", 5);
+	glBindTexture(GL_TEXTURE_2D, tileDepthBounds);
+	glActiveTexture(GL_TEXTURE6);
+	lightCullingShader.setInt("tileDepthMask", 6);
+	glBindTexture(GL_TEXTURE_2D, tileDepthMask);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, dynamicViewLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, dynamicViewLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, dynamicLightIndicesBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, dynamicLightGridBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, dynamicLightIndexCounterBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, cullingStatsBuffer);
+
+	glDispatchCompute(workGroupsX, workGroupsY, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// back to the lists the final pass reads
+	BindLightLists(mode);
+}
+
+// Runs the light culling compute pass for the current view and depth map
+void DispatchLightCulling(CullingMode mode)
+{
+	MarkPass(CullingStart);
+	// reset the index pool allocator and the debug counters
+	GLuint zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightIndexCounterBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullingStatsBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightCountBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	// stage 0: transform the lights to view space once for every tile and drop those outside the camera
+	// frustum, the Z-binned mode keeps the depth sorted order its bins refer to and tests every light
+	if (mode == CullingMode::ZBinned)
+	{
+		UpdateZBins();
+	}
+	bool gatherStaticLights = SplitDynamicLights(mode);
+
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, mode == CullingMode::ZBinned ? sortedLightBuffer : lightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, mode == CullingMode::ZBinned ? sortedLightColorBuffer : lightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, mode == CullingMode::ZBinned ? sortedLightShapeBuffer : lightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 11, viewLightBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 12, viewLightColorBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 13, viewLightSourceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, viewLightCountBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 16, viewLightShapeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 17, lightFadeBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 18, sortedLightSourceBuffer);
+
+	// the static lights of the grid cells in the frustum, one work group per cell
+	if (gatherStaticLights && !lightGrid.cells.empty())
+	{
+		// 0 is the cleared stamp
+		if (++frameStamp == 0)
+		{
+			++frameStamp;
+		}
+		staticLightTransformShader.use();
+		SetLightTransformUniforms(staticLightTransformShader, mode);
+		staticLightTransformShader.setVec3("gridMin", lightGrid.minBounds);
+		staticLightTransformShader.setVec3("gridCellSize", lightGrid.cellSize);
+		staticLightTransformShader.setInt3("gridDimensions", lightGrid.dimensions);
+		staticLightTransformShader.setUint("frameStamp", frameStamp);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 19, lightStampBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 20, staticLightGridBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 21, staticLightIndicesBuffer);
+
+		glDispatchCompute(GLuint(lightGrid.cells.size()), 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+
+	// every light, with the grid the dynamic ones go to their own lists once the tile depth is known
+	if (!gatherStaticLights)
+	{
+		lightTransformShader.use();
+		SetLightTransformUniforms(lightTransformShader, mode);
+		lightTransformShader.setInt("firstLight", 0);
+
+		glDispatchCompute((lightCount + 255) / 256, 1, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+	GLuint outputBindings[] = { 11, 12, 13, 16, 17, 18, 19, 20, 21 };
+	for (GLuint binding : outputBindings)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+	MarkPass(TransformEnd);
+
+	// stage 0.5: the light BVH the BVH mode walks instead of the light list
+	if (mode == CullingMode::Bvh)
+	{
+		BuildLightBvh();
+	}
+	MarkPass(BvhEnd);
+
+	// stage 1: min/max depth per tile from the level of the depth pyramid matching the tile size, and the
+	// per pixel depth occupancy for the modes that use the 2.5D depth mask
+	depthReductionShader.use();
+	depthReductionShader.setMat4("projection", projection);
+	depthReductionShader.setInt2("tileCount", ivec2(workGroupsX, workGroupsY));
+
+	glActiveTexture(GL_TEXTURE5);
+	depthReductionShader.setInt("depthPyramid", 5);
+	glBindTexture(GL_TEXTURE_2D, depthPyramid);
+	glBindImageTexture(0, tileDepthBounds, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+
+	glDispatchCompute((workGroupsX + 7) / 8, (workGroupsY + 7) / 8, 1);
+
+	if (depthMaskCulling && (mode == CullingMode::Tiled || mode == CullingMode::Bvh))
+	{
+		depthMaskShader.use();
+		depthMaskShader.setMat4("projection", projection);
+		depthMaskShader.setInt2("screenSize", SCREEN_SIZE);
+		depthMaskShader.setInt("depthPyramid", 5);
+
+		glActiveTexture(GL_TEXTURE4);
+		depthMaskShader.setInt("depthMap", 4);
+		glBindTexture(GL_TEXTURE_2D, depthMap);
+		glBindImageTexture(1, tileDepthMask, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32UI);
+
+		glDispatchCompute(workGroupsX, workGroupsY, 1);
+	}
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	MarkPass(ReductionEnd);
+
+	// stage 2: optionally bin lights into super tiles so the fine pass scans fewer lights, the BVH
+	// already narrows down the lights per tile
+	if (hierarchicalCulling && mode != CullingMode::ZBinned && mode != CullingMode::Bvh)
+	{
+		coarseCullingShader.use();
+		coarseCullingShader.setMat4("projection", projection);
+		coarseCullingShader.setInt2("tileCount", ivec2(workGroupsX, workGroupsY));
+
+		glActiveTexture(GL_TEXTURE5);
+		coarseCullingShader.setInt("tileDepthBounds", 5);
+		glBindTexture(GL_TEXTURE_2D, tileDepthBounds);
+
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, viewLightBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, viewLightShapeBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, cullingStatsBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, coarseLightGridBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, coarseLightIndicesBuffer);
+
+		glDispatchCompute(superTilesX, superTilesY, 1);
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	}
+	MarkPass(CoarseEnd);
+
+	// stage 3: cull lights against every tile
+	if (mode == CullingMode::ZBinned)
+	{
+		zBinCullingShader.use();
+		zBinCullingShader.setMat4("projection", projection);
+		zBinCullingShader.setInt("lightCount", lightCount);
+
+		glActiveTexture(GL_TEXTURE5);
+		zBinCullingShader.setInt("tileDepthBounds", 5);
+		glBindTexture(GL_TEXTURE_2D, tileDepthBounds);
+	}
+	else
+	{
+		Program& cullingShader = mode == CullingMode::Clustered ? clusterCullingShader
+			: mode == CullingMode::Bvh ? bvhCullingShader : lightCullingShader;
+
+		cullingShader.use();
+		cullingShader.setMat4("projection", projection);
+		cullingShader.setInt2("screenSize", SCREEN_SIZE);
+		cullingShader.setUint("indexPoolSize", indexPoolSize);
+		cullingShader.setBool("packedIndices", packedLightIndices);
+		cullingShader.setFloat("near", near);
+		cullingShader.setFloat("far", far);
+		cullingShader.setBool("depthMaskCulling", depthMaskCulling);
+		cullingShader.setBool("hierarchicalCulling", hierarchicalCulling);
+
+		glActiveTexture(GL_TEXTURE5);
+		cullingShader.setInt("tileDepthBounds", 5);
+		glBindTexture(GL_TEXTURE_2D, tileDepthBounds);
+		glActiveTexture(GL_TEXTURE6);
+		cullingShader.setInt("tileDepthMask", 6);
+		glBindTexture(GL_TEXTURE_2D, tileDepthMask);
+	}
+
+	BindLightLists(mode);
+
+	glDispatchCompute(workGroupsX, workGroupsY, 1);
+	// make the index lists visible to the final shading pass
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+	MarkPass(CullingEnd);
+	// outside the culling timestamps, which cover the main lists only
+	if (SplitDynamicLights(mode))
+	{
+		DispatchDynamicLightCulling(mode);
+	}
+
+	// Unbind the depth textures
+	glActiveTexture(GL_TEXTURE6);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE5);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glActiveTexture(GL_TEXTURE4);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Times the culling dispatch over a sweep of light radii, which controls how many lights land in each tile
+void BenchmarkLightCulling()
+{
+	const float radii[] = { 5.0f, 10.0f, 20.0f, 30.0f, 45.0f, 60.0f, 90.0f };
+	const int iterations = 20;
+	size_t numberOfTiles = workGroupsX * workGroupsY;
+	size_t numberOfLists = numberOfTiles * (cullingMode == CullingMode::Clustered ? CLUSTER_SLICES : 1);
+
+	cout << "Light culling benchmark (" << CullingModeName(cullingMode) << ", " << lightCount << " lights)" << endl;
+	cout << "radius\tlights per list\tdepth mask rejected\tdispatch (ms)" << endl;
+	for (float radius : radii)
+	{
+		SetupLights(radius);
+		// warm up
+		DispatchLightCulling(cullingMode);
+
+		// only the culling dispatch, the transform, BVH build, depth reduction, coarse pass and dynamic light
+		// lists are left out. Every iteration marks its own pair of queries, read once after the loop so the
+		// CPU never waits for the GPU in between
+		GLuint queries[iterations * 2];
+		glGenQueries(iterations * 2, queries);
+		GLuint coarseEnd = passTimestamps[CoarseEnd];
+		GLuint cullingEnd = passTimestamps[CullingEnd];
+		timePasses = true;
+		for (int i = 0; i < iterations; ++i)
+		{
+			passTimestamps[CoarseEnd] = queries[2 * i];
+			passTimestamps[CullingEnd] = queries[2 * i + 1];
+			DispatchLightCulling(cullingMode);
+		}
+		timePasses = false;
+		passTimestamps[CoarseEnd] = coarseEnd;
+		passTimestamps[CullingEnd] = cullingEnd;
+
+		GLuint64 elapsed = 0;
+		for (int i = 0; i < iterations; ++i)
+		{
+			GLuint64 start = 0, end = 0;
+			glGetQueryObjectui64v(queries[2 * i], GL_QUERY_RESULT, &start);
+			glGetQueryObjectui64v(queries[2 * i + 1], GL_QUERY_RESULT, &end);
+			elapsed += end - start;
+		}
+		glDeleteQueries(iterations * 2, queries);
+
+		// average list length of the last dispatch
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		size_t visibleCount = 0;
+		if (cullingMode == CullingMode::ZBinned)
+		{
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileLightMaskBuffer);
+			GLuint* maskBuffer = (GLuint*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+			for (size_t i = 0; i < numberOfTiles * lightWords; ++i)
+			{
+				visibleCount += bitset<32>(maskBuffer[i]).count();
+			}
+		}
+		else
+		{
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightGridBuffer);
+			LightGridCell* gridBuffer = (LightGridCell*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+			for (size_t i = 0; i < numberOfLists; ++i)
+			{
+				visibleCount += gridBuffer[i].count;
+			}
+		}
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+
+		CullingStats stats;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullingStatsBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(CullingStats), &stats);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		cout << radius << "\t" << float(visibleCount) / numberOfLists << "\t" << stats.depthMaskRejectedLights
+			<< "\t" << elapsed / (iterations * 1.0e6) << endl;
+	}
+
+	// restore the default scene
+	SetupLights();
+}
+
+// Checks the GPU tiled culling result of the current frame against the CPU reference culler
+void CompareLightCulling()
+{
+	// the CPU culler only has the plane test
+	if ((cullingMode != CullingMode::Tiled && cullingMode != CullingMode::Bvh) || lightTileTest != LightTileTest::Plane
+		|| depthMaskCulling || lightLod)
 	{
-		PointLight& light = pointLights[i];
-		light.position = vec4(RandomPosition(dis, gen), 1.0f);
-		light.color = vec4(1.0f + dis(gen), 1.0f + dis(gen), 1.0f + dis(gen), 1.0f);
-		light.paddingAndRadius = vec4(0.0f, 0.0f, 0.0f, LIGHT_RADIUS);
+		cout << "Culling comparison needs the tiled or BVH mode with the plane light tile test, depth mask culling and light LOD off" << endl;
+		return;
 	}
+	size_t numberOfTiles = workGroupsX * workGroupsY;
+
+	DispatchLightCulling(cullingMode);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
 
+	vector<vec2> depthBounds(numberOfTiles);
+	glBindTexture(GL_TEXTURE_2D, tileDepthBounds);
+	glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, depthBounds.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// the GPU lists index the view lights, or their Morton ordered copy, map them back to the scene lights
+	GLuint viewLightCount = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightCountBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &viewLightCount);
+	vector<GLuint> viewLightSources(viewLightCount);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullingMode == CullingMode::Bvh ? sortedLightSourceBuffer : viewLightSourceBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, viewLightCount * sizeof(GLuint), viewLightSources.data());
+
+	// with the static light grid the dynamic lights have their own lists, merged into every tile below
+	vector<LightGridCell> dynamicGrid;
+	vector<GLuint> dynamicIndices;
+	vector<GLuint> dynamicLightSources;
+	if (SplitDynamicLights(cullingMode))
+	{
+		GLuint dynamicLightCount = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightCountBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &dynamicLightCount);
+		dynamicLightSources.resize(dynamicLightCount);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightSourceBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, dynamicLightCount * sizeof(GLuint), dynamicLightSources.data());
+		dynamicGrid.resize(numberOfTiles);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicLightGridBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, numberOfTiles * sizeof(LightGridCell), dynamicGrid.data());
+		dynamicIndices.resize(dynamicIndexPoolSize);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicLightIndicesBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, dynamicIndexPoolSize * sizeof(GLuint), dynamicIndices.data());
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	SyncSceneLights(lightCount);
+	CpuLightCuller culler(workGroupsX, workGroupsY);
+	auto start = chrono::high_resolution_clock::now();
+	culler.cull(sceneLights, view, projection, depthBounds);
+	auto end = chrono::high_resolution_clock::now();
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightGridBuffer);
+	LightGridCell* gridBuffer = (LightGridCell*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleLightIndicesBuffer);
+	GLuint* visibleBuffer = (GLuint*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+
+	size_t mismatchedTiles = 0;
+	vector<GLuint> gpuLights;
+	for (size_t i = 0; i < numberOfTiles; ++i)
+	{
+		// the GPU list order depends on thread scheduling
+		const LightGridCell& cell = gridBuffer[i];
+		gpuLights.resize(cell.count);
+		for (GLuint j = 0; j < cell.count; ++j)
+		{
+			GLuint viewLight = packedLightIndices ? (visibleBuffer[cell.offset + j / 2] >> ((j & 1) * 16)) & 0xFFFF : visibleBuffer[cell.offset + j];
+			gpuLights[j] = viewLightSources[viewLight];
+		}
+		if (!dynamicGrid.empty())
+		{
+			const LightGridCell& dynamicCell = dynamicGrid[i];
+			for (GLuint j = 0; j < dynamicCell.count; ++j)
+			{
+				gpuLights.push_back(dynamicLightSources[dynamicIndices[dynamicCell.offset + j]]);
+			}
+		}
+		sort(gpuLights.begin(), gpuLights.end());
+
+		const LightGridCell& reference = culler.grid[i];
+		auto first = culler.indices.begin() + reference.offset;
+		if (gpuLights.size() != reference.count || !equal(gpuLights.begin(), gpuLights.end(), first))
+		{
+			vector<GLuint> missing, extra;
+			set_difference(first, first + reference.count, gpuLights.begin(), gpuLights.end(), back_inserter(missing));
+			set_difference(gpuLights.begin(), gpuLights.end(), first, first + reference.count, back_inserter(extra));
+			cout << "Tile " << i << ": " << missing.size() << " lights missing, " << extra.size() << " extra" << endl;
+			++mismatchedTiles;
+		}
+	}
+
+	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightGridBuffer);
 	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	cout << "CPU culling (" << CpuLightCuller::simdName() << ", " << culler.threadCount << " threads): "
+		<< chrono::duration<double, milli>(end - start).count() << " ms, "
+		<< mismatchedTiles << " of " << numberOfTiles << " tiles differ from the GPU" << endl;
+}
+
+// Capacity of a tile or super tile light list, lights beyond it are counted as overflowed
+int MaxLightsPerList()
+{
+	return std::min(NUM_LIGHTS, MAX_SHARED_LIGHTS);
+}
+
+// Capacity of a cluster light list
+int MaxLightsPerCluster()
+{
+	return std::min(NUM_LIGHTS, MAX_LIGHTS_PER_CLUSTER);
+}
+
+// Fine tiles per super tile side for the current tile size
+int SuperTileTiles()
+{
+	return std::max(SUPER_TILE_SIZE / tileSize, 1);
+}
+
+// Tile configuration shared by every shader that depends on it
+std::string TileShaderDefines()
+{
+	return "#define TILE_SIZE " + to_string(tileSize) + "\n"
+		+ "#define MAX_LIGHTS_PER_TILE " + to_string(MaxLightsPerList()) + "\n"
+		+ "#define MAX_LIGHTS_PER_SUPER_TILE " + to_string(MaxLightsPerList()) + "\n"
+		+ "#define MAX_LIGHTS_PER_CLUSTER " + to_string(MaxLightsPerCluster()) + "\n"
+		+ "#define SUPER_TILE_TILES " + to_string(SuperTileTiles()) + "\n"
+		+ "#define MAX_LIGHT_WORDS " + to_string((NUM_LIGHTS + 31) / 32) + "\n"
+		+ "#define LIGHT_TILE_TEST " + to_string(int(lightTileTest)) + "\n";
+}
+
+// (Re)loads the programs specialized for the current tile size
+void LoadTileShaders()
+{
+	Program* programs[] = { &depthReductionShader, &depthMaskShader, &coarseCullingShader, &lightCullingShader, &clusterCullingShader, &bvhCullingShader,
+		&zBinCullingShader, &finalShader };
+	for (Program* program : programs)
+	{
+		if (program->id != 0)
+		{
+			glDeleteProgram(program->id);
+		}
+	}
+
+	std::string defines = TileShaderDefines();
+	depthReductionShader = Program(R"(shaders\depth_reduction_comp.glsl)", defines);
+	depthMaskShader = Program(R"(shaders\depth_reduction_comp.glsl)", defines + "#define TILE_DEPTH_MASK\n");
+	coarseCullingShader = Program(R"(shaders\coarse_culling_comp.glsl)", defines);
+	lightCullingShader = Program(R"(shaders\light_culling_comp.glsl)", defines);
+	clusterCullingShader = Program(R"(shaders\cluster_culling_comp.glsl)", defines);
+	bvhCullingShader = Program(R"(shaders\bvh_culling_comp.glsl)", defines);
+	zBinCullingShader = Program(R"(shaders\zbin_culling_comp.glsl)", defines);
+	finalShader = Program(R"(shaders\final_shading_vert.glsl)", R"(shaders\final_shading_frag.glsl)",
+		defines + (BindlessTexturesSupported() ? "#define BINDLESS_TEXTURES\n" : ""));
+}
+
+// Sizes every per tile texture and buffer for the current tile size
+void ResizeTileResources()
+{
+	cullingValid = false;
+	workGroupsX = (Width + tileSize - 1) / tileSize;
+	workGroupsY = (Height + tileSize - 1) / tileSize;
+	auto numberOfTiles = workGroupsX * workGroupsY;
+	superTilesX = (workGroupsX + SuperTileTiles() - 1) / SuperTileTiles();
+	superTilesY = (workGroupsY + SuperTileTiles() - 1) / SuperTileTiles();
+
+	// tile depth bounds written by the depth reduction pass
+	glBindTexture(GL_TEXTURE_2D, tileDepthBounds);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, workGroupsX, workGroupsY, 0, GL_RG, GL_FLOAT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+	// tile depth occupancy written by the depth reduction pass
+	glBindTexture(GL_TEXTURE_2D, tileDepthMask);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, workGroupsX, workGroupsY, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// visible light indices buffer, a pool shared by all tiles or clusters
+	indexPoolSize = numberOfTiles * CLUSTER_SLICES * AVERAGE_LIGHTS_PER_CLUSTER;
+	if (packedLightIndices)
+	{
+		indexPoolSize /= 2;
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleLightIndicesBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, indexPoolSize * sizeof(GLuint), 0, GL_STATIC_DRAW);
+
+	// light grid buffer, sized for the clustered mode which has the most cells
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightGridBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, numberOfTiles * CLUSTER_SLICES * sizeof(LightGridCell), 0, GL_STATIC_DRAW);
+
+	// coarse light grid and indices buffer
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, coarseLightGridBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, superTilesX * superTilesY * sizeof(LightGridCell), 0, GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, coarseLightIndicesBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, superTilesX * superTilesY * MaxLightsPerList() * sizeof(GLuint), 0, GL_STATIC_DRAW);
+
+	// per tile lists of the dynamic lights
+	dynamicIndexPoolSize = numberOfTiles * DYNAMIC_LIGHTS;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicLightIndicesBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, dynamicIndexPoolSize * sizeof(GLuint), 0, GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicLightGridBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, numberOfTiles * sizeof(LightGridCell), 0, GL_STATIC_DRAW);
+
+	// per tile light mask of the Z-binned mode
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileLightMaskBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, numberOfTiles * lightWords * sizeof(GLuint), 0, GL_STATIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// Sizes every buffer that scales with the light capacity NUM_LIGHTS
+void ResizeLightResources()
+{
+	cullingValid = false;
+	packedLightIndices = NUM_LIGHTS <= 0x10000;
+	lightWords = (NUM_LIGHTS + 31) / 32;
+
+	// two GPU only position/radius copies for the animation ping-pong, the colors and shapes, filled by
+	// copies from the light ring, immutable storage so they are recreated to resize
+	GLuint* buffers[] = { &lightBuffer, &animatedLightBuffer, &lightColorBuffer, &lightShapeBuffer };
+	GLsizeiptr sizes[] = { GLsizeiptr(NUM_LIGHTS * sizeof(vec4)), GLsizeiptr(NUM_LIGHTS * sizeof(vec4)), GLsizeiptr(NUM_LIGHTS * sizeof(uvec2)),
+		GLsizeiptr(NUM_LIGHTS * sizeof(vec4)) };
+	for (int i = 0; i < 4; ++i)
+	{
+		if (*buffers[i] != 0)
+		{
+			glDeleteBuffers(1, buffers[i]);
+		}
+		glGenBuffers(1, buffers[i]);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, *buffers[i]);
+		glBufferStorage(GL_SHADER_STORAGE_BUFFER, sizes[i], 0, 0);
+	}
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortedLightBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(vec4), 0, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortedLightColorBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(uvec2), 0, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortedLightShapeBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(vec4), 0, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, sortedLightSourceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_DRAW);
+
+	// every light starts fully faded in
+	float fadedIn = 1.0f;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightFadeBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(float), 0, GL_DYNAMIC_COPY);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, &fadedIn);
+
+	// no light gathered from the static light grid yet
+	GLuint zero = 0;
+	frameStamp = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightStampBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+
+	// Morton codes, radix sort and tree of the BVH mode, n - 1 internal nodes and a parent per node and leaf
+	GLsizeiptr blocks = (NUM_LIGHTS + RADIX_BLOCK - 1) / RADIX_BLOCK;
+	for (int i = 0; i < 2; ++i)
+	{
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mortonKeyBuffers[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, mortonValueBuffers[i]);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, radixHistogramBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, (1 << RADIX_BITS) * blocks * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhNodeBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * 2 * sizeof(vec4), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhParentBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * NUM_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, bvhVisitBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+
+	// view lights written by the transform pass, at most every light
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(vec4), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightColorBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(uvec2), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightShapeBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(vec4), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightSourceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	lightManager.initialize(NUM_LIGHTS);
+}
+
+// Changes the light capacity and recreates the scene lights, shaders and buffers for it
+void SetLightCapacity(int capacity)
+{
+	NUM_LIGHTS = capacity;
+	ResizeLightResources();
+	LoadTileShaders();
+	ResizeTileResources();
+	SetupLights();
+}
+
+// Culls the model meshes on the GPU into visibleCommandBuffer, with the occlusion test against the depth
+// pyramid of the previous prepass. A mesh that comes out from behind an occluder appears a frame late
+void CullMeshes(const mat4& model)
+{
+	GLuint zero = 0;
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawCountBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	if (!IndirectDrawCountSupported())
+	{
+		// every command is drawn, those past the visible ones keep zero instances
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleCommandBuffer);
+		glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &zero);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	meshCullingShader.use();
+	meshCullingShader.setMat4("modelViewProjection", projection * view * model);
+	meshCullingShader.setInt("meshCount", sponzaModel.commandCount);
+	meshCullingShader.setInt("pyramidLevels", depthPyramidLevels);
+	meshCullingShader.setInt2("screenSize", SCREEN_SIZE);
+	meshCullingShader.setBool("occlusionCulling", depthPyramidValid);
+
+	glActiveTexture(GL_TEXTURE4);
+	meshCullingShader.setInt("depthPyramid", 4);
+	glBindTexture(GL_TEXTURE_2D, depthPyramid);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 31, sponzaModel.boundsBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 32, sponzaModel.commandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 33, visibleCommandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 34, drawCountBuffer);
+
+	glDispatchCompute((sponzaModel.commandCount + 63) / 64, 1, 1);
+	// the draws read the commands and their count
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+
+	for (GLuint binding = 31; binding <= 34; ++binding)
+	{
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, 0);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Reduces the depth map of the prepass into the min/max depth pyramid, one level per dispatch
+void BuildDepthPyramid()
+{
+	depthPyramidShader.use();
+	depthPyramidShader.setInt2("screenSize", SCREEN_SIZE);
+
+	glActiveTexture(GL_TEXTURE4);
+	depthPyramidShader.setInt("depthMap", 4);
+	glBindTexture(GL_TEXTURE_2D, depthMap);
+
+	for (int level = 0; level < depthPyramidLevels; ++level)
+	{
+		glm::ivec2 levelSize = glm::max(glm::ivec2(depthPyramidSize.x >> level, depthPyramidSize.y >> level), glm::ivec2(1));
+		depthPyramidShader.setBool("firstLevel", level == 0);
+		glBindImageTexture(0, depthPyramid, std::max(level - 1, 0), GL_FALSE, 0, GL_READ_ONLY, GL_RG32F);
+		glBindImageTexture(1, depthPyramid, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_RG32F);
+
+		glDispatchCompute((levelSize.x + 7) / 8, (levelSize.y + 7) / 8, 1);
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	depthPyramidValid = true;
+}
+
+void RenderDepthPrepass(const mat4& model)
+{
+	if (meshCulling)
+	{
+		CullMeshes(model);
+	}
+
+	depthShader.use();
+	depthShader.setMat4("projection", projection);
+	depthShader.setMat4("view", view);
+	depthShader.setMat4("model", model);
+
+	// the textures are only sampled for the alpha cutout the final pass relies on
+	glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	if (meshCulling)
+	{
+		sponzaModel.draw(depthShader, visibleCommandBuffer, drawCountBuffer);
+	}
+	else
+	{
+		sponzaModel.draw(depthShader);
+	}
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	// tile depth bounds of this frame and occluders of the next frame's mesh culling
+	BuildDepthPyramid();
+}
+
+void RenderFinalShading(const mat4& model)
+{
+	MarkPass(ShadingStart);
+	// shade against the depth of the prepass, only the fragment that wrote it passes
+	glBindFramebuffer(GL_FRAMEBUFFER, shadingFBO);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_EQUAL);
+
+	finalShader.use();
+	finalShader.setMat4("model", model);
+	finalShader.setInt("numberOfTilesX", workGroupsX);
+	finalShader.setMat4("projection", projection);
+	finalShader.setMat4("view", view);
+	finalShader.setInt("cullingMode", int(cullingMode));
+	finalShader.setUint("lightWords", lightWords);
+	finalShader.setBool("packedIndices", packedLightIndices);
+	finalShader.setBool("collectLightStats", captureLightStats);
+	finalShader.setBool("dynamicLightLists", SplitDynamicLights(cullingMode));
+	finalShader.setFloat("near", near);
+	finalShader.setFloat("far", far);
+
+	if (meshCulling)
+	{
+		// the meshes left by the last prepass, culling only reruns with it
+		sponzaModel.draw(finalShader, visibleCommandBuffer, drawCountBuffer);
+	}
+	else
+	{
+		sponzaModel.draw(finalShader);
+	}
+	glDepthFunc(GL_LEQUAL);
+	glDepthMask(GL_TRUE);
+
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, shadingFBO);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	glBlitFramebuffer(0, 0, Width, Height, 0, 0, Width, Height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	MarkPass(ShadingEnd);
+}
+
+// Steers the importance LOD threshold towards the frame budget with the GPU time of the previous frame
+void UpdateLodThreshold()
+{
+	int previous = frameTimeQuery ^ 1;
+	GLint available = 0;
+	if (frameTimeQueried[previous])
+	{
+		glGetQueryObjectiv(frameTimeQueries[previous], GL_QUERY_RESULT_AVAILABLE, &available);
+	}
+	// skip a frame rather than wait for the GPU
+	if (!available || !lightLod)
+	{
+		return;
+	}
+	GLuint64 elapsed = 0;
+	glGetQueryObjectui64v(frameTimeQueries[previous], GL_QUERY_RESULT, &elapsed);
+	float frameTime = elapsed / 1.0e6f;
+
+	// raise the threshold while over budget, lower it again with some headroom
+	if (frameTime > frameBudget)
+	{
+		lodThreshold = std::max(lodThreshold * LOD_THRESHOLD_STEP, LOD_MIN_THRESHOLD);
+	}
+	else if (frameTime < 0.9f * frameBudget && lodThreshold > 0.0f)
+	{
+		lodThreshold /= LOD_THRESHOLD_STEP;
+		if (lodThreshold < LOD_MIN_THRESHOLD)
+		{
+			lodThreshold = 0.0f;
+		}
+	}
+}
+
+// Times culling plus shading for every tile size on this GPU and resolution and keeps the fastest
+void AutoTuneTileSize()
+{
+	const int tileSizes[] = { 8, 16, 32 };
+	const int iterations = 20;
+
+	projection = perspective(camera.zoom, float(Width / Height), near, far);
+	view = camera.GetViewMatrix();
+	mat4 model = scale(mat4(1.0), vec3(0.1f, 0.1f, 0.1f));
+	glViewport(0, 0, Width, Height);
+
+	GLuint query;
+	glGenQueries(1, &query);
+
+	int bestTileSize = tileSize;
+	GLuint64 bestElapsed = ~GLuint64(0);
+	cout << "Tile size auto-tune (" << CullingModeName(cullingMode) << ", " << Width << "x" << Height << ")" << endl;
+	cout << "tile size\tframe (ms)" << endl;
+	for (int size : tileSizes)
+	{
+		tileSize = size;
+		LoadTileShaders();
+		ResizeTileResources();
+
+		RenderDepthPrepass(model);
+		// warm up
+		DispatchLightCulling(cullingMode);
+		RenderFinalShading(model);
+
+		glBeginQuery(GL_TIME_ELAPSED, query);
+		for (int i = 0; i < iterations; ++i)
+		{
+			DispatchLightCulling(cullingMode);
+			RenderFinalShading(model);
+		}
+		glEndQuery(GL_TIME_ELAPSED);
+
+		GLuint64 elapsed = 0;
+		glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+		cout << size << "\t" << elapsed / (iterations * 1.0e6) << endl;
+		if (elapsed < bestElapsed)
+		{
+			bestElapsed = elapsed;
+			bestTileSize = size;
+		}
+	}
+	glDeleteQueries(1, &query);
+
+	tileSize = bestTileSize;
+	LoadTileShaders();
+	ResizeTileResources();
+	cout << "Using tile size " << tileSize << endl;
+}
+
+// Sweeps the light count from 1K to 64K and reports the GPU time of every pass and the dropped lights
+void StressTestLightCount()
+{
+	const int lightCounts[] = { 1024, 2048, 4096, 8192, 16384, 32768, 65536 };
+	const int frames = 10;
+	int defaultLightCount = NUM_LIGHTS;
+
+	projection = perspective(camera.zoom, float(Width / Height), near, far);
+	view = camera.GetViewMatrix();
+	mat4 model = scale(mat4(1.0), vec3(0.1f, 0.1f, 0.1f));
+	glViewport(0, 0, Width, Height);
+
+	cout << "Light count stress test (" << CullingModeName(cullingMode) << ")" << endl;
+	cout << "lights\tanimation\ttransform\tBVH build\tdepth reduction\tcoarse\tculling\tshading (ms)\toverflowed\tpool overflowed" << endl;
+	for (int count : lightCounts)
+	{
+		SetLightCapacity(count);
+
+		double passTimes[7] = {};
+		timePasses = true;
+		for (int frame = 0; frame <= frames; ++frame)
+		{
+			UpdateLights();
+			RenderDepthPrepass(model);
+			DispatchLightCulling(cullingMode);
+			RenderFinalShading(model);
+
+			GLuint64 timestamps[PASS_TIMESTAMPS];
+			for (int i = 0; i < PASS_TIMESTAMPS; ++i)
+			{
+				glGetQueryObjectui64v(passTimestamps[i], GL_QUERY_RESULT, &timestamps[i]);
+			}
+			// the first frame is a warm up
+			if (frame > 0)
+			{
+				passTimes[0] += (timestamps[AnimationEnd] - timestamps[AnimationStart]) / 1.0e6;
+				passTimes[1] += (timestamps[TransformEnd] - timestamps[CullingStart]) / 1.0e6;
+				passTimes[2] += (timestamps[BvhEnd] - timestamps[TransformEnd]) / 1.0e6;
+				passTimes[3] += (timestamps[ReductionEnd] - timestamps[BvhEnd]) / 1.0e6;
+				passTimes[4] += (timestamps[CoarseEnd] - timestamps[ReductionEnd]) / 1.0e6;
+				passTimes[5] += (timestamps[CullingEnd] - timestamps[CoarseEnd]) / 1.0e6;
+				passTimes[6] += (timestamps[ShadingEnd] - timestamps[ShadingStart]) / 1.0e6;
+			}
+		}
+		timePasses = false;
+
+		CullingStats stats;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullingStatsBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(CullingStats), &stats);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		cout << count;
+		for (double time : passTimes)
+		{
+			cout << "\t" << time / frames;
+		}
+		cout << "\t" << stats.overflowedLights << "\t" << stats.poolOverflowedLights << endl;
+	}
+
+	// restore the default scene
+	SetLightCapacity(defaultLightCount);
 }
 
 bool Window::initializeProgram()
 {
-    depthShader = Program(R"(shaders\depth_vert.glsl)", R"(shaders\depth_frag.glsl)");
+    depthShader = Program(R"(shaders\depth_vert.glsl)", R"(shaders\depth_frag.glsl)",
+		BindlessTexturesSupported() ? "#define BINDLESS_TEXTURES\n" : "");
 	depthRenderShader = Program(R"(shaders\depthRender_vert.glsl)", R"(shaders\depthRender_frag.glsl)");
-	lightCullingShader = Program(R"(shaders\light_culling_comp.glsl)");
-	finalShader = Program(R"(shaders\final_shading_vert.glsl)", R"(shaders\final_shading_frag.glsl)");
+	lightAnimationShader = Program(R"(shaders\light_animation_comp.glsl)");
+	lightTransformShader = Program(R"(shaders\light_transform_comp.glsl)");
+	staticLightTransformShader = Program(R"(shaders\light_transform_comp.glsl)", "#define STATIC_LIGHT_GRID\n");
+	mortonCodeShader = Program(R"(shaders\light_bvh_comp.glsl)", "#define MORTON_CODES\n");
+	bvhNodeShader = Program(R"(shaders\light_bvh_comp.glsl)", "#define BVH_NODES\n");
+	bvhBoundsShader = Program(R"(shaders\light_bvh_comp.glsl)");
+	radixHistogramShader = Program(R"(shaders\radix_sort_comp.glsl)", "#define RADIX_HISTOGRAM\n");
+	radixScanShader = Program(R"(shaders\radix_sort_comp.glsl)", "#define RADIX_SCAN\n");
+	radixScatterShader = Program(R"(shaders\radix_sort_comp.glsl)");
+	zBinKeyShader = Program(R"(shaders\zbin_sort_comp.glsl)", "#define DEPTH_KEYS\n");
+	zBinGatherShader = Program(R"(shaders\zbin_sort_comp.glsl)");
+	depthPyramidShader = Program(R"(shaders\depth_pyramid_comp.glsl)");
+	meshCullingShader = Program(R"(shaders\mesh_culling_comp.glsl)");
+	LoadTileShaders();
 
 	return true;
 }
@@ -169,31 +1695,135 @@ bool Window::initializeObjects()
     glDrawBuffer(GL_NONE);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
     
+    // final pass obj, shares the depth map of the prepass
+    glGenFramebuffers(1, &shadingFBO);
+    
+    glGenTextures(1, &shadingColor);
+    glBindTexture(GL_TEXTURE_2D, shadingColor);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, Width, Height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
+    glBindFramebuffer(GL_FRAMEBUFFER, shadingFBO);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, shadingColor, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthMap, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    
+    // min/max depth pyramid, level 0 halves the padded screen
+    depthPyramidSize = glm::ivec2(1);
+    while (depthPyramidSize.x < Width) depthPyramidSize.x *= 2;
+    while (depthPyramidSize.y < Height) depthPyramidSize.y *= 2;
+    depthPyramidSize = glm::max(depthPyramidSize / 2, glm::ivec2(1));
+    depthPyramidLevels = 1;
+    while ((std::max(depthPyramidSize.x, depthPyramidSize.y) >> depthPyramidLevels) > 0) ++depthPyramidLevels;
+    
+    glGenTextures(1, &depthPyramid);
+    glBindTexture(GL_TEXTURE_2D, depthPyramid);
+    glTexStorage2D(GL_TEXTURE_2D, depthPyramidLevels, GL_RG32F, depthPyramidSize.x, depthPyramidSize.y);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    
 	// model
     sponzaModel = Model(R"(model\sponza.obj)");
+    
+    // the mesh commands left by culling, at most every mesh, and their count
+    glGenBuffers(1, &visibleCommandBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleCommandBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sponzaModel.commandCount * sizeof(DrawElementsIndirectCommand), 0, GL_DYNAMIC_COPY);
+    glGenBuffers(1, &drawCountBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawCountBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
 	initScene();
+	if (autoTuneTileSize)
+	{
+		AutoTuneTileSize();
+	}
     
 	return true;
 }
 void Window::initScene()
 {
-    // tile size 16 x 16
-    workGroupsX = (Width + (Width % 16)) / 16;
-    workGroupsY = (Height + (Height % 16)) / 16;
-    auto numberOfTiles = workGroupsX * workGroupsY;
+    // tile depth bounds and occupancy, sized by ResizeTileResources
+    glGenTextures(1, &tileDepthBounds);
+    glGenTextures(1, &tileDepthMask);
     
-    // Generate lightbuffer
-    glGenBuffers(1, &lightBuffer);
+    // Generate lightbuffer, the light buffers are created by ResizeLightResources
     glGenBuffers(1, &visibleLightIndicesBuffer);
+    glGenBuffers(1, &lightGridBuffer);
+    glGenBuffers(1, &lightIndexCounterBuffer);
+    glGenBuffers(1, &cullingStatsBuffer);
+    glGenBuffers(1, &coarseLightGridBuffer);
+    glGenBuffers(1, &coarseLightIndicesBuffer);
+    glGenBuffers(1, &sortedLightBuffer);
+    glGenBuffers(1, &sortedLightColorBuffer);
+    glGenBuffers(1, &sortedLightShapeBuffer);
+    glGenBuffers(1, &sortedLightSourceBuffer);
+    glGenBuffers(1, &lightFadeBuffer);
+    glGenBuffers(1, &lightStampBuffer);
+    glGenBuffers(1, &staticLightGridBuffer);
+    glGenBuffers(1, &staticLightIndicesBuffer);
+    glGenBuffers(1, &viewLightBuffer);
+    glGenBuffers(1, &viewLightColorBuffer);
+    glGenBuffers(1, &viewLightShapeBuffer);
+    glGenBuffers(1, &viewLightSourceBuffer);
+    glGenBuffers(1, &viewLightCountBuffer);
+    glGenBuffers(1, &dynamicViewLightBuffer);
+    glGenBuffers(1, &dynamicViewLightColorBuffer);
+    glGenBuffers(1, &dynamicViewLightShapeBuffer);
+    glGenBuffers(1, &dynamicViewLightSourceBuffer);
+    glGenBuffers(1, &dynamicViewLightCountBuffer);
+    glGenBuffers(1, &dynamicLightIndicesBuffer);
+    glGenBuffers(1, &dynamicLightGridBuffer);
+    glGenBuffers(1, &dynamicLightIndexCounterBuffer);
+    glGenBuffers(1, &tileLightMaskBuffer);
+    glGenBuffers(1, &zBinBuffer);
+    glGenBuffers(2, mortonKeyBuffers);
+    glGenBuffers(2, mortonValueBuffers);
+    glGenBuffers(1, &radixHistogramBuffer);
+    glGenBuffers(1, &bvhNodeBuffer);
+    glGenBuffers(1, &bvhParentBuffer);
+    glGenBuffers(1, &bvhVisitBuffer);
     
-    // Bind light Buffer
-    glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightBuffer);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, NUM_LIGHTS * sizeof(PointLight), 0, GL_DYNAMIC_DRAW);
-
-	// Bind visible light indices buffer
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleLightIndicesBuffer);
-	glBufferData(GL_SHADER_STORAGE_BUFFER, numberOfTiles * sizeof(VisibleIndex) * 1024, 0, GL_STATIC_DRAW);
+	// Bind light index counter buffer
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightIndexCounterBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), 0, GL_DYNAMIC_DRAW);
+
+	// Bind view light count buffer
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightCountBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), 0, GL_DYNAMIC_DRAW);
+
+	// view lights and allocator of the dynamic light lists, at most DYNAMIC_LIGHTS
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, DYNAMIC_LIGHTS * sizeof(vec4), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightColorBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, DYNAMIC_LIGHTS * sizeof(uvec2), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightShapeBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, DYNAMIC_LIGHTS * sizeof(vec4), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightSourceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, DYNAMIC_LIGHTS * sizeof(GLuint), 0, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicViewLightCountBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), 0, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, dynamicLightIndexCounterBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), 0, GL_DYNAMIC_DRAW);
+
+	// Bind culling stats buffer
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullingStatsBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(CullingStats), 0, GL_DYNAMIC_DRAW);
+
+	// Bind Z-bin buffer
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, zBinBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, Z_BINS * sizeof(ZBin), 0, GL_DYNAMIC_DRAW);
+
+	glGenQueries(PASS_TIMESTAMPS, passTimestamps);
+	glGenQueries(2, frameTimeQueries);
+
+	// light and per tile buffers
+	ResizeLightResources();
+	ResizeTileResources();
 
 	// setup lights
 	SetupLights();
@@ -202,6 +1832,7 @@ void Window::initScene()
 void Window::cleanUp()
 {
 	// Deallcoate the objects.
+	lightManager.release();
 
 }
 
@@ -218,8 +1849,9 @@ GLFWwindow* Window::createWindow(int width, int height)
 		return NULL;
 	}
 
-	// 4x antialiasing.
-	glfwWindowHint(GLFW_SAMPLES, 4);
+	// No multisampling, the final pass is resolved into the window by a blit, which needs a single sample
+	// window, and it shades against the single sample prepass depth.
+	glfwWindowHint(GLFW_SAMPLES, 0);
     glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
 	// Apple implements its own version of OpenGL and requires special treatments
 	// to make it uses modern OpenGL.
@@ -268,7 +1900,10 @@ void Window::idleCallback()
 {
 	// Perform any updates as necessary.
 
-	// UpdateLights();
+	if (animateLights)
+	{
+		UpdateLights();
+	}
 }
 
 
@@ -287,16 +1922,25 @@ void Window::displayCallback(GLFWwindow* window)
 	glViewport(0, 0, Width, Height);
 	mat4 model = mat4(1.0);
 	model = scale(model, vec3(0.1f, 0.1f, 0.1f));
-	// step 1: depth prepass
-	depthShader.use();
-	depthShader.setMat4("projection", projection);
-	depthShader.setMat4("view", view);
-	depthShader.setMat4("model", model);
+	// stream the lights edited on the CPU
+	if (streamLights)
+	{
+		StreamLights();
+	}
+	bool lightsChanged = UploadLights();
+	// the fade of the light LOD and the stats counters change every culling pass. With split lists moving
+	// or edited lights only touch the dynamic lists, a static light edit regrids and invalidates culling
+	bool splitLists = SplitDynamicLights(cullingMode);
+	bool recull = !cullingValid || view != culledView || lightLod || captureLightStats || (!splitLists && (lightsChanged || animateLights));
 
-	glBindFramebuffer(GL_FRAMEBUFFER, depthMapFBO);
-	glClear(GL_DEPTH_BUFFER_BIT);
-	sponzaModel.draw(depthShader);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0); 
+	UpdateLodThreshold();
+	glBeginQuery(GL_TIME_ELAPSED, frameTimeQueries[frameTimeQuery]);
+
+	// step 1: depth prepass, only the culling reads it
+	if (recull)
+	{
+		RenderDepthPrepass(model);
+	}
 
 #if defined(DEPTH_RENDER)
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -309,60 +1953,128 @@ void Window::displayCallback(GLFWwindow* window)
 #endif
 
 	// step 2: light culling
-	lightCullingShader.use();
-	lightCullingShader.setMat4("projection", projection);
-	lightCullingShader.setMat4("view", view);
-	lightCullingShader.setInt("lightCount", NUM_LIGHTS);
-	lightCullingShader.setInt2("screenSize", SCREEN_SIZE);
-
-	glActiveTexture(GL_TEXTURE4);
-	lightCullingShader.setInt("depthMap", 4);
-	glBindTexture(GL_TEXTURE_2D, depthMap);
-
-
-	// Bind shader storage buffer objects for the light and indice buffers
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, lightBuffer);
-	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, visibleLightIndicesBuffer);
-
-	glDispatchCompute(workGroupsX, workGroupsY, 1);
-
-	// Unbind the depth map
-	glActiveTexture(GL_TEXTURE4);
-	glBindTexture(GL_TEXTURE_2D, 0);
+	if (recull)
+	{
+		DispatchLightCulling(cullingMode);
+		cullingValid = true;
+		culledView = view;
+	}
+	else if (splitLists && (lightsChanged || animateLights))
+	{
+		DispatchDynamicLightCulling(cullingMode);
+	}
+	else
+	{
+		BindLightLists(cullingMode);
+	}
 
 #if defined(CULLING_CHECK)
-	// map indices buffer back
-	glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleLightIndicesBuffer);
-	VisibleIndex* visibleBuffer = (VisibleIndex*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_WRITE);
+	// map grid and indices buffer back
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
 	size_t numberOfTiles = workGroupsX * workGroupsY;
-	for (int i = 0; i < numberOfTiles; ++i)
+	if (cullingMode == CullingMode::ZBinned)
 	{
-		cout << "Tile " << i << "==============" << endl;
-		uint offset = i * 1024;
-		for (uint i = 0; i < NUM_LIGHTS && visibleBuffer[offset + i].index != -1; ++i)
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, tileLightMaskBuffer);
+		GLuint* maskBuffer = (GLuint*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+		for (int i = 0; i < numberOfTiles; ++i)
 		{
-			cout << visibleBuffer[offset + i].index << endl;
+			cout << "Tile " << i << "==============" << endl;
+			for (uint j = 0; j < lightCount; ++j)
+			{
+				if (maskBuffer[i * lightWords + j / 32] & (1u << (j % 32)))
+				{
+					cout << j << endl;
+				}
+			}
 		}
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
 	}
+	else
+	{
+		bool clustered = cullingMode == CullingMode::Clustered;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightGridBuffer);
+		LightGridCell* gridBuffer = (LightGridCell*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, visibleLightIndicesBuffer);
+		GLuint* visibleBuffer = (GLuint*)glMapBuffer(GL_SHADER_STORAGE_BUFFER, GL_READ_ONLY);
+		size_t numberOfLists = clustered ? numberOfTiles * CLUSTER_SLICES : numberOfTiles;
+		for (int i = 0; i < numberOfLists; ++i)
+		{
+			cout << (clustered ? "Cluster " : "Tile ") << i << "==============" << endl;
+			const LightGridCell& cell = gridBuffer[i];
+			for (uint i = 0; i < cell.count; ++i)
+			{
+				if (packedLightIndices)
+				{
+					cout << ((visibleBuffer[cell.offset + i / 2] >> ((i & 1) * 16)) & 0xFFFF) << endl;
+				}
+				else
+				{
+					cout << visibleBuffer[cell.offset + i] << endl;
+				}
+			}
+		}
 
-	glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightGridBuffer);
+		glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
+	}
 	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 #endif
 	// step 3: final shading
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	RenderFinalShading(model);
 
-	finalShader.use();
-	finalShader.setMat4("model", model);
-	finalShader.setInt("numberOfTilesX", workGroupsX);
-	finalShader.setMat4("projection", projection);
-	finalShader.setMat4("view", view);
-	finalShader.setVec3("viewPosition", camera.position);
+	glEndQuery(GL_TIME_ELAPSED);
+	frameTimeQueried[frameTimeQuery] = true;
+	frameTimeQuery ^= 1;
 
-	sponzaModel.draw(finalShader);
+	if (captureLightStats)
+	{
+		// lights accepted by culling that do not light the fragment are false positives
+		CullingStats stats;
+		glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, cullingStatsBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(CullingStats), &stats);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+		GLuint falsePositives = stats.shadedLights - stats.contributingLights;
+		cout << "Shaded lights: " << stats.shadedLights << ", contributing: " << stats.contributingLights
+			<< ", false positives: " << falsePositives << " ("
+			<< (stats.shadedLights ? 100.0f * falsePositives / stats.shadedLights : 0.0f) << "%)" << endl;
+		GLuint viewLightCount = 0;
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, viewLightCountBuffer);
+		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &viewLightCount);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		cout << "Lights in view: " << viewLightCount << " of " << lightCount << endl;
+		if (lightLod)
+		{
+			cout << "Light LOD threshold: " << lodThreshold << " (" << frameBudget << " ms budget)" << endl;
+		}
+		cout << "Overflowed lights: " << stats.overflowedLights << " (full lists), "
+			<< stats.poolOverflowedLights << " (index pool)" << endl;
+		if (meshCulling)
+		{
+			GLuint drawCount = 0;
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, drawCountBuffer);
+			glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &drawCount);
+			glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+			cout << "Meshes drawn: " << drawCount << " of " << sponzaModel.commandCount << endl;
+		}
+		captureLightStats = false;
+	}
 
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
 	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 5, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 14, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 15, 0);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 27, 0);
 
     // Gets events, including input such as keyboard and mouse or window resizing.
     glfwPollEvents();
@@ -419,6 +2131,97 @@ void Window::keyCallback(GLFWwindow* window, int key, int scancode, int action,
 			case GLFW_KEY_S:
 				camera.ProcessKeyboard(BACKWARD, deltaTime);
 				break;
+			case GLFW_KEY_C:
+				// cycle through tiled, clustered, Z-binned and BVH light culling
+				cullingMode = CullingMode((int(cullingMode) + 1) % (int(CullingMode::Bvh) + 1));
+				cout << "Culling mode: " << CullingModeName(cullingMode) << endl;
+				cullingValid = false;
+				break;
+			case GLFW_KEY_T:
+				// cycle the light vs tile test of the tiled mode, compare the false positives with F
+				lightTileTest = LightTileTest((int(lightTileTest) + 1) % (int(LightTileTest::Cone) + 1));
+				cout << "Light tile test: " << LightTileTestName(lightTileTest) << endl;
+				LoadTileShaders();
+				cullingValid = false;
+				break;
+			case GLFW_KEY_M:
+				// toggle 2.5D depth mask culling
+				depthMaskCulling = !depthMaskCulling;
+				cout << "Depth mask culling: " << (depthMaskCulling ? "on" : "off") << endl;
+				cullingValid = false;
+				break;
+			case GLFW_KEY_H:
+				// toggle the coarse super tile pre-pass
+				hierarchicalCulling = !hierarchicalCulling;
+				cout << "Hierarchical culling: " << (hierarchicalCulling ? "on" : "off") << endl;
+				cullingValid = false;
+				break;
+			case GLFW_KEY_F:
+				captureLightStats = true;
+				break;
+			case GLFW_KEY_O:
+				// toggle the frustum and occlusion culling of the meshes
+				meshCulling = !meshCulling;
+				cout << "Mesh culling: " << (meshCulling ? "on" : "off") << endl;
+				cullingValid = false;
+				break;
+			case GLFW_KEY_L:
+				// pause or resume the light animation
+				animateLights = !animateLights;
+				cout << "Light animation: " << (animateLights ? "on" : "off") << endl;
+				break;
+			case GLFW_KEY_K:
+				// stream the last lights from the CPU every frame
+				streamLights = !streamLights;
+				cout << "Streamed lights: " << (streamLights ? to_string(std::min<size_t>(lightHandles.size(), STREAMED_LIGHTS)) : "off") << endl;
+				break;
+			case GLFW_KEY_I:
+				// toggle the importance LOD, the threshold restarts from zero
+				lightLod = !lightLod;
+				lodThreshold = 0.0f;
+				if (!lightLod)
+				{
+					// bring the faded lights back at once, culling no longer runs every frame to fade them in
+					float fadedIn = 1.0f;
+					glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightFadeBuffer);
+					glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32F, GL_RED, GL_FLOAT, &fadedIn);
+					glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+					cullingValid = false;
+				}
+				cout << "Light LOD: " << (lightLod ? "on" : "off") << endl;
+				break;
+			case GLFW_KEY_G:
+				// toggle the static light grid, the static lights stop moving while it is on
+				staticLightGrid = !staticLightGrid;
+				if (staticLightGrid)
+				{
+					UpdateStaticLightGrid();
+					cout << "Static light grid: " << FirstDynamicLight() << " static lights in " << lightGrid.dimensions.x << "x"
+						<< lightGrid.dimensions.y << "x" << lightGrid.dimensions.z << " cells, " << lightGrid.indices.size() << " entries" << endl;
+				}
+				else
+				{
+					cout << "Static light grid: off" << endl;
+				}
+				cullingValid = false;
+				break;
+			case GLFW_KEY_EQUAL:
+			case GLFW_KEY_MINUS:
+				// change the frame budget the light LOD aims for
+				frameBudget = std::max(frameBudget + (key == GLFW_KEY_EQUAL ? 1.0f : -1.0f), 1.0f);
+				cout << "Frame budget: " << frameBudget << " ms" << endl;
+				break;
+			case GLFW_KEY_N:
+				// sweep the light count from 1K to 64K
+				StressTestLightCount();
+				break;
+			case GLFW_KEY_B:
+				BenchmarkLightCulling();
+				break;
+			case GLFW_KEY_V:
+				// verify the GPU tile lists against the CPU culler
+				CompareLightCulling();
+				break;
             default:
                 break;
 		}
@@ -31,6 +31,23 @@ enum class Target
     Object
 };
 
+// light culling strategy used by the compute pass
+enum class CullingMode
+{
+    Tiled,      // one depth range per 16x16 tile
+    Clustered,  // exponential depth slices per 16x16 tile
+    ZBinned,    // per tile light bitmask intersected with CPU built depth bins
+    Bvh         // per tile lists from a walk of a GPU built light BVH
+};
+
+// light vs tile test of the tiled mode, must match light_culling_comp.glsl
+enum class LightTileTest
+{
+    Plane,  // light volume against the six tile frustum planes
+    Aabb,   // sphere against the view space AABB of the tile frustum
+    Cone    // sphere against the cone around the tile plus the depth range
+};
+
 class Window
 {
 public:
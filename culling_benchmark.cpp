@@ -0,0 +1,91 @@
+//
+//  culling_benchmark.cpp
+//
+//  Standalone CPU light culling benchmark, built without GL so it runs on
+//  machines without a GPU. Build with LightCulling.cpp, e.g.
+//  g++ -O2 -mavx -pthread culling_benchmark.cpp LightCulling.cpp Camera.cpp
+//
+
+#include "LightCulling.hpp"
+#include "Camera.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+	// same scene as Window.cpp
+	const ivec2 SCREEN_SIZE(1080, 720);
+	const vec3 LIGHT_MIN_BOUNDS = vec3(-135.0f, -20.0f, -60.0f);
+	const vec3 LIGHT_MAX_BOUNDS = vec3(135.0f, 170.0f, 60.0f);
+	const float LIGHT_RADIUS = 30.0f;
+	const float SPOT_LIGHT_FRACTION = 0.3f;
+	const float CAPSULE_LIGHT_FRACTION = 0.2f;
+	const float near = 0.1f;
+	const float far = 300.0f;
+	const int iterations = 20;
+	int numberOfLights = argc > 1 ? atoi(argv[1]) : 1024;
+
+	int tilesX = (SCREEN_SIZE.x + 15) / 16;
+	int tilesY = (SCREEN_SIZE.y + 15) / 16;
+
+	Camera camera(vec3(-40.0f, 10.0f, 0.0f));
+	mat4 view = camera.GetViewMatrix();
+	mat4 projection = perspective(camera.zoom, float(SCREEN_SIZE.x) / SCREEN_SIZE.y, near, far);
+
+	mt19937 gen(1);
+	uniform_real_distribution<float> dis(0.0f, 1.0f);
+	vector<Light> lights(numberOfLights);
+	for (Light& light : lights)
+	{
+		vec3 position = LIGHT_MIN_BOUNDS + vec3(dis(gen), dis(gen), dis(gen)) * (LIGHT_MAX_BOUNDS - LIGHT_MIN_BOUNDS);
+		float type = dis(gen);
+		if (type < SPOT_LIGHT_FRACTION)
+		{
+			vec3 direction(dis(gen) - 0.5f, -1.0f, dis(gen) - 0.5f);
+			light = MakeSpotLight(position, direction, LIGHT_RADIUS, radians(20.0f + 25.0f * dis(gen)), vec4(1.0f));
+		}
+		else if (type < SPOT_LIGHT_FRACTION + CAPSULE_LIGHT_FRACTION)
+		{
+			vec3 halfAxis = vec3(dis(gen) - 0.5f, 0.0f, dis(gen) - 0.5f) * LIGHT_RADIUS;
+			light = MakeCapsuleLight(position, halfAxis, 0.5f * LIGHT_RADIUS, vec4(1.0f));
+		}
+		else
+		{
+			light = MakePointLight(position, LIGHT_RADIUS, vec4(1.0f));
+		}
+	}
+
+	// synthetic depth bounds standing in for the depth prepass
+	vector<vec2> depthBounds(tilesX * tilesY);
+	for (vec2& bounds : depthBounds)
+	{
+		float minDepth = near + dis(gen) * 100.0f;
+		bounds = vec2(minDepth, minDepth + dis(gen) * 50.0f);
+	}
+
+	cout << numberOfLights << " lights, " << tilesX << "x" << tilesY << " tiles, " << CpuLightCuller::simdName() << endl;
+	cout << "threads\tlights per tile\tcull (ms)" << endl;
+	unsigned threadCounts[] = { 1, 0 };
+	for (unsigned threadCount : threadCounts)
+	{
+		CpuLightCuller culler(tilesX, tilesY, threadCount);
+		// warm up
+		culler.cull(lights, view, projection, depthBounds);
+
+		auto start = chrono::high_resolution_clock::now();
+		for (int i = 0; i < iterations; ++i)
+		{
+			culler.cull(lights, view, projection, depthBounds);
+		}
+		auto end = chrono::high_resolution_clock::now();
+
+		cout << culler.threadCount << "\t" << float(culler.indices.size()) / culler.grid.size() << "\t"
+			<< chrono::duration<double, milli>(end - start).count() / iterations << endl;
+	}
+	return 0;
+}
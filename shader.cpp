@@ -120,9 +120,9 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	return ProgramID;
 }
 
-Program::Program(const char* comp_file_path)
+Program::Program(const char* comp_file_path, const std::string& defines)
 {
-	id = LoadShaders(comp_file_path);
+	id = LoadShaders(comp_file_path, defines);
 }
 Program::Program(const char *vertex_file_path, const char *fragment_file_path, const char *geometry_file_path)
 {
@@ -130,12 +130,12 @@ Program::Program(const char *vertex_file_path, const char *fragment_file_path, c
 }
 
 
-Program::Program(const char* vertex_file_path, const char* frag_file_path)
+Program::Program(const char* vertex_file_path, const char* frag_file_path, const std::string& defines)
 {
-	id = LoadShaders(vertex_file_path, frag_file_path);
+	id = LoadShaders(vertex_file_path, frag_file_path, defines);
 }
 
-GLuint Program::LoadSingleShader(const char * shaderFilePath, ShaderType type)
+GLuint Program::LoadSingleShader(const char * shaderFilePath, ShaderType type, const std::string& defines)
 {
 	// Create a shader id.
 	GLuint shaderID = 0;
@@ -167,6 +167,14 @@ GLuint Program::LoadSingleShader(const char * shaderFilePath, ShaderType type)
 		return 0;
 	}
 
+	// Insert the defines after the #version line, which must come first.
+	if (!defines.empty())
+	{
+		size_t version = shaderCode.find("#version");
+		size_t lineEnd = version == std::string::npos ? 0 : shaderCode.find('\n', version);
+		shaderCode.insert(lineEnd == std::string::npos ? shaderCode.size() : lineEnd + 1, defines);
+	}
+
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
@@ -185,7 +193,9 @@ GLuint Program::LoadSingleShader(const char * shaderFilePath, ShaderType type)
 		glGetShaderInfoLog(shaderID, InfoLogLength, NULL, shaderErrorMessage.data());
 		std::string msg(shaderErrorMessage.begin(), shaderErrorMessage.end());
 		std::cerr << msg << std::endl;
-		return 0;
+		// warnings, e.g. an optional #extension the driver lacks, still compile
+		if (Result == GL_FALSE)
+			return 0;
 	}
 	else
 	{
@@ -202,11 +212,11 @@ GLuint Program::LoadSingleShader(const char * shaderFilePath, ShaderType type)
 	return shaderID;
 }
 
-GLuint Program::LoadShaders(const char * vertexFilePath, const char * fragmentFilePath)
+GLuint Program::LoadShaders(const char * vertexFilePath, const char * fragmentFilePath, const std::string& defines)
 {
 	// Create the vertex shader and fragment shader.
-	GLuint vertexShaderID = LoadSingleShader(vertexFilePath, vertex);
-	GLuint fragmentShaderID = LoadSingleShader(fragmentFilePath, fragment);
+	GLuint vertexShaderID = LoadSingleShader(vertexFilePath, vertex, defines);
+	GLuint fragmentShaderID = LoadSingleShader(fragmentFilePath, fragment, defines);
 
 	// Check both shaders.
 	if (vertexShaderID == 0 || fragmentShaderID == 0) return 0;
@@ -246,9 +256,9 @@ GLuint Program::LoadShaders(const char * vertexFilePath, const char * fragmentFi
 
 	return programID;
 }
-GLuint Program::LoadShaders(const char* comp_file_path)
+GLuint Program::LoadShaders(const char* comp_file_path, const std::string& defines)
 {
-	GLuint computeShaderID = LoadSingleShader(comp_file_path, compute);
+	GLuint computeShaderID = LoadSingleShader(comp_file_path, compute, defines);
 	if (computeShaderID == 0)
 		return 0;
 
@@ -352,6 +362,10 @@ void Program::setInt(const char *name, int value) const
 {
 	glUniform1i(glGetUniformLocation(id, name), value);
 }
+void Program::setUint(const char *name, GLuint value) const
+{
+	glUniform1ui(glGetUniformLocation(id, name), value);
+}
 void Program::setFloat(const char *name, float value) const
 {
 	glUniform1f(glGetUniformLocation(id, name), value);
@@ -367,4 +381,8 @@ void Program::setMat4(const char *name, glm::mat4 value) const
 void Program::setInt2(const char* name, glm::ivec2 value) const
 {
 	glUniform2iv(glGetUniformLocation(id, name), 1, &value[0]);
+}
+void Program::setInt3(const char* name, glm::ivec3 value) const
+{
+	glUniform3iv(glGetUniformLocation(id, name), 1, &value[0]);
 }
\ No newline at end of file
@@ -21,26 +21,29 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 class Program {
 public:
 	enum ShaderType { vertex, fragment, geometry, compute };
-	GLuint id;
+	GLuint id = 0;
 	Program() {}
-	Program(const char* comp_file_path);
-	Program(const char* vertex_file_path, const char* frag_file_path);
+	// defines are "#define NAME VALUE" lines inserted after the #version line of every stage
+	Program(const char* comp_file_path, const std::string& defines = "");
+	Program(const char* vertex_file_path, const char* frag_file_path, const std::string& defines = "");
 	Program(const char* vertex_file_path, const char* frag_file_path, const char* geo_file_path);
 	void use();
     void unuse();
 
 	void setBool(const char* name, bool value) const;
 	void setInt(const char* name, int value) const;
+	void setUint(const char* name, GLuint value) const;
 	void setFloat(const char* name, float value) const;
 	void setVec3(const char* name, glm::vec3 value) const;
 	void setMat4(const char* name, glm::mat4 value) const;
 	void setInt2(const char* name, glm::ivec2 value) const;
+	void setInt3(const char* name, glm::ivec3 value) const;
 private:
 
-	GLuint LoadSingleShader(const char * shaderFilePath, ShaderType type);
-	GLuint LoadShaders(const char * vertex_file_path, const char * fragment_file_path);
+	GLuint LoadSingleShader(const char * shaderFilePath, ShaderType type, const std::string& defines = "");
+	GLuint LoadShaders(const char * vertex_file_path, const char * fragment_file_path, const std::string& defines);
 	GLuint LoadShaders(const char * vertex_file_path, const char * fragment_file_path, const char * geometry_file_path);
-	GLuint LoadShaders(const char* comp_file_path);
+	GLuint LoadShaders(const char* comp_file_path, const std::string& defines);
 
 
 };
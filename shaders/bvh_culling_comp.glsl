@@ -0,0 +1,357 @@
+#version 430
+
+// Tiled light culling against the light BVH of light_bvh_comp.glsl. Every tile walks the tree breadth
+// first through a shared frontier instead of testing every view light, so the work per tile follows
+// the lights near it rather than the light count.
+
+struct LightGridCell {
+	uint offset;
+	uint count;
+};
+
+struct BvhNode {
+	vec3 aabbMin;
+	// child index, LEAF_NODE set for a light
+	uint left;
+	vec3 aabbMax;
+	uint right;
+};
+
+// storage buffer objects
+// view space xyz position, w radius of the lights in the camera frustum in Morton order, a leaf of the
+// tree is the light at the same index
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+// w == 0 point, w > 0 spot with the cosine of the cone angle and xyz direction,
+// w < 0 capsule with minus the range and xyz half segment, see Light in LightCulling.hpp
+layout(std430, binding = 15) readonly buffer LightShapeBuffer{
+	vec4 data[];
+} lightShapeBuffer;
+
+// global pool of visible light indices, every tile owns a range of it
+layout(std430, binding = 1) writeonly buffer VisibleLightIndicesBuffer{
+	uint data[];
+} visibleLightIndicesBuffer;
+
+// (offset, count) of the range in the index pool per tile
+layout(std430, binding = 2) writeonly buffer LightGridBuffer{
+	LightGridCell data[];
+} lightGridBuffer;
+
+// atomic allocator of the index pool, cleared every frame
+layout(std430, binding = 3) buffer LightIndexCounter{
+	uint next;
+} lightIndexCounter;
+
+// debug counters, cleared every frame
+layout(std430, binding = 4) buffer CullingStats{
+	uint depthMaskRejectedLights;
+	uint shadedLights;
+	uint contributingLights;
+	// lights dropped because a list was full or the index pool ran out
+	uint overflowedLights;
+	uint poolOverflowedLights;
+} cullingStats;
+
+// number of lights in lightBuffer, written by light_transform_comp.glsl
+layout(std430, binding = 14) readonly buffer ViewLightCount{
+	uint count;
+} viewLightCount;
+
+// internal nodes with view space bounds, the root is node 0
+layout(std430, binding = 27) readonly buffer BvhNodeBuffer{
+	BvhNode data[];
+} bvhNodeBuffer;
+
+// uniform
+// linear min/max view depth per tile from depth_reduction_comp.glsl
+uniform sampler2D tileDepthBounds;
+// 32 bin depth occupancy per tile from depth_reduction_comp.glsl
+uniform usampler2D tileDepthMask;
+// reject lights that only cover empty depth bins of the tile
+uniform bool depthMaskCulling;
+uniform mat4 projection;
+// size of the index pool in uints
+uniform uint indexPoolSize;
+// two 16 bit indices per uint
+uniform bool packedIndices;
+
+// defaults, Window.cpp injects the configured values when loading the shader
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+#ifndef MAX_LIGHTS_PER_TILE
+#define MAX_LIGHTS_PER_TILE 1024
+#endif
+
+// must match light_bvh_comp.glsl
+#define LEAF_NODE 0x80000000u
+// nodes of one tree level in shared memory, subtrees that do not fit are walked by one thread
+#define FRONTIER_SIZE 512
+// deeper than the tree can get with 30 bit codes and the index tie break
+#define STACK_SIZE 64
+#define DEPTH_MASK_BINS 32
+
+// shared values
+shared uint visibleLightCount;
+// range of this tile in the index pool
+shared uint tileOffset;
+shared uint tileWords;
+shared vec4 frustumPlanes[6];
+// shared local storage for visible indices
+shared int visibleLightIndices[MAX_LIGHTS_PER_TILE];
+// tree entries to visit in this and the next step
+shared uint frontier[2 * FRONTIER_SIZE];
+shared uint frontierCount[2];
+
+// tile values every thread reads
+float minDepth;
+float maxDepth;
+uint depthMask;
+float binScale;
+
+// signed distance of the farthest point of the light volume to a normalized plane, outside when <= 0,
+// must match LightPlaneDistance in LightCulling.hpp
+float lightPlaneDistance(vec4 positionAndRadius, vec4 shape, vec4 plane)
+{
+	float center = dot(positionAndRadius.xyz, plane.xyz) + plane.w;
+	float sphere = center + positionAndRadius.w;
+	float axis = dot(shape.xyz, plane.xyz);
+	if(shape.w > 0.0)
+	{
+		// spot cone clipped to the range sphere, the apex or the rim of the base is farthest
+		float range = positionAndRadius.w;
+		float baseRadius = range * sqrt(1.0 - shape.w * shape.w) / shape.w;
+		float base = center + range * axis + baseRadius * sqrt(max(1.0 - axis * axis, 0.0));
+		return min(sphere, max(center, base));
+	}
+	if(shape.w < 0.0)
+	{
+		// capsule, the farther segment end plus the range
+		return center + abs(axis) - shape.w;
+	}
+	return sphere;
+}
+
+// nearest and farthest view depth of a view space light volume
+vec2 lightDepthRange(vec4 positionAndRadius, vec4 shape)
+{
+	return vec2(-lightPlaneDistance(positionAndRadius, shape, vec4(0.0, 0.0, 1.0, 0.0)),
+		lightPlaneDistance(positionAndRadius, shape, vec4(0.0, 0.0, -1.0, 0.0)));
+}
+
+// the box is outside the tile when its corner farthest along a plane normal is behind the plane
+bool boxInTile(vec3 aabbMin, vec3 aabbMax)
+{
+	for(uint j = 0; j < 6; ++j)
+	{
+		vec3 corner = mix(aabbMin, aabbMax, greaterThan(frustumPlanes[j].xyz, vec3(0.0)));
+		if(dot(frustumPlanes[j].xyz, corner) + frustumPlanes[j].w <= 0.0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// the full light test of light_culling_comp.glsl for a leaf, appending the light if it passes
+void visitLight(uint lightIndex)
+{
+	vec4 positionAndRadius = lightBuffer.data[lightIndex];
+	vec4 shape = lightShapeBuffer.data[lightIndex];
+	for(uint j = 0; j < 6; ++j)
+	{
+		if(lightPlaneDistance(positionAndRadius, shape, frustumPlanes[j]) <= 0.0)
+		{
+			return;
+		}
+	}
+	if(depthMaskCulling)
+	{
+		// 2.5D culling, the light must cover at least one occupied depth bin
+		vec2 lightDepth = lightDepthRange(positionAndRadius, shape);
+		uint firstBin = uint(clamp((lightDepth.x - minDepth) * binScale, 0.0, float(DEPTH_MASK_BINS - 1)));
+		uint lastBin = uint(clamp((lightDepth.y - minDepth) * binScale, 0.0, float(DEPTH_MASK_BINS - 1)));
+		uint lightMask = (0xFFFFFFFFu >> (31u - lastBin)) & (0xFFFFFFFFu << firstBin);
+		if((lightMask & depthMask) == 0)
+		{
+			atomicAdd(cullingStats.depthMaskRejectedLights, 1);
+			return;
+		}
+	}
+	uint offset = atomicAdd(visibleLightCount, 1);
+	if(offset < MAX_LIGHTS_PER_TILE)
+	{
+		visibleLightIndices[offset] = int(lightIndex);
+	}
+}
+
+// depth first walk of a subtree by one thread
+void visitSubtree(uint root)
+{
+	uint stack[STACK_SIZE];
+	uint top = 0;
+	stack[top++] = root;
+	while(top > 0)
+	{
+		uint entry = stack[--top];
+		if((entry & LEAF_NODE) != 0)
+		{
+			visitLight(entry & ~LEAF_NODE);
+			continue;
+		}
+		BvhNode node = bvhNodeBuffer.data[entry];
+		if(boxInTile(node.aabbMin, node.aabbMax) && top + 2 <= STACK_SIZE)
+		{
+			stack[top++] = node.right;
+			stack[top++] = node.left;
+		}
+	}
+}
+
+// tests one frontier entry and queues the children of an internal node that overlaps the tile
+void visitEntry(uint entry, uint next)
+{
+	if((entry & LEAF_NODE) != 0)
+	{
+		visitLight(entry & ~LEAF_NODE);
+		return;
+	}
+	BvhNode node = bvhNodeBuffer.data[entry];
+	if(!boxInTile(node.aabbMin, node.aabbMax))
+	{
+		return;
+	}
+	uint children[2] = uint[2](node.left, node.right);
+	for(uint i = 0; i < 2; ++i)
+	{
+		uint slot = atomicAdd(frontierCount[next], 1);
+		if(slot < FRONTIER_SIZE)
+		{
+			frontier[next * FRONTIER_SIZE + slot] = children[i];
+		}
+		else
+		{
+			visitSubtree(children[i]);
+		}
+	}
+}
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE, local_size_z = 1) in;
+void main()
+{
+	ivec2 tileID = ivec2(gl_WorkGroupID.xy);
+	ivec2 tileNumber = ivec2(gl_NumWorkGroups.xy);
+	uint index = tileID.y * tileNumber.x + tileID.x;
+
+	// max/min depth of the current tile
+	vec2 depthBounds = texelFetch(tileDepthBounds, tileID, 0).rg;
+	minDepth = depthBounds.x;
+	maxDepth = depthBounds.y;
+	depthMask = texelFetch(tileDepthMask, tileID, 0).r;
+	binScale = float(DEPTH_MASK_BINS) / max(maxDepth - minDepth, 1e-6);
+
+	// initialize global values
+	if(gl_LocalInvocationIndex == 0)
+	{
+		visibleLightCount = 0;
+
+		vec2 negativeStep = (2.0 * vec2(tileID)) / vec2(tileNumber);
+		vec2 positiveStep = (2.0 * vec2(tileID + ivec2(1, 1))) / vec2(tileNumber);
+
+		// Set up starting values for planes using steps and min and max z values
+		frustumPlanes[0] = vec4(1.0, 0.0, 0.0, 1.0 - negativeStep.x); // Left
+		frustumPlanes[1] = vec4(-1.0, 0.0, 0.0, -1.0 + positiveStep.x); // Right
+		frustumPlanes[2] = vec4(0.0, 1.0, 0.0, 1.0 - negativeStep.y); // Bottom
+		frustumPlanes[3] = vec4(0.0, -1.0, 0.0, -1.0 + positiveStep.y); // Top
+		frustumPlanes[4] = vec4(0.0, 0.0, -1.0, -minDepth); // Near
+		frustumPlanes[5] = vec4(0.0, 0.0, 1.0, maxDepth); // Far
+
+		// Transform the first four planes, the lights are already in view space
+		for(uint i = 0; i < 4; ++i)
+		{
+			frustumPlanes[i] *= projection;
+			frustumPlanes[i] /= length(frustumPlanes[i].xyz);
+		}
+
+		// start at the root, a single light is a leaf without internal nodes
+		uint lightCount = viewLightCount.count;
+		frontier[0] = lightCount == 1 ? LEAF_NODE : 0u;
+		frontierCount[0] = min(lightCount, 1u);
+	}
+
+	// cull lights, one tree level per step
+	uint threadCount = TILE_SIZE * TILE_SIZE;
+	uint current = 0;
+	while(true)
+	{
+		barrier();
+
+		uint entries = min(frontierCount[current], FRONTIER_SIZE);
+		if(entries == 0)
+		{
+			break;
+		}
+		if(gl_LocalInvocationIndex == 0)
+		{
+			frontierCount[current ^ 1] = 0;
+		}
+
+		barrier();
+
+		for(uint i = gl_LocalInvocationIndex; i < entries; i += threadCount)
+		{
+			visitEntry(frontier[current * FRONTIER_SIZE + i], current ^ 1);
+		}
+		current ^= 1;
+	}
+
+	barrier();
+
+	// allocate a range in the index pool
+	if(gl_LocalInvocationIndex == 0)
+	{
+		// the shared list keeps the first MAX_LIGHTS_PER_TILE lights
+		uint count = min(visibleLightCount, MAX_LIGHTS_PER_TILE);
+		if(visibleLightCount > count)
+		{
+			atomicAdd(cullingStats.overflowedLights, visibleLightCount - count);
+		}
+		uint words = packedIndices ? (count + 1) / 2 : count;
+		uint offset = atomicAdd(lightIndexCounter.next, words);
+
+		// clamp the list if the pool is exhausted
+		uint available = offset < indexPoolSize ? indexPoolSize - offset : 0u;
+		if(words > available)
+		{
+			words = available;
+			uint kept = packedIndices ? words * 2 : words;
+			atomicAdd(cullingStats.poolOverflowedLights, count - kept);
+			count = kept;
+		}
+
+		tileOffset = offset;
+		tileWords = words;
+		lightGridBuffer.data[index].offset = offset;
+		lightGridBuffer.data[index].count = count;
+	}
+
+	barrier();
+
+	// copy result back to global buffer, spread over the whole work group
+	for(uint i = gl_LocalInvocationIndex; i < tileWords; i += threadCount)
+	{
+		if(packedIndices)
+		{
+			uint low = uint(visibleLightIndices[2 * i]);
+			uint high = 2 * i + 1 < min(visibleLightCount, MAX_LIGHTS_PER_TILE) ? uint(visibleLightIndices[2 * i + 1]) : 0xFFFFu;
+			visibleLightIndicesBuffer.data[tileOffset + i] = low | (high << 16);
+		}
+		else
+		{
+			visibleLightIndicesBuffer.data[tileOffset + i] = uint(visibleLightIndices[i]);
+		}
+	}
+}
@@ -0,0 +1,289 @@
+#version 430
+
+struct LightGridCell {
+	uint offset;
+	uint count;
+};
+
+// storage buffer objects
+// view space xyz position, w radius of the lights in the camera frustum from light_transform_comp.glsl
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+// w == 0 point, w > 0 spot with the cosine of the cone angle and xyz direction,
+// w < 0 capsule with minus the range and xyz half segment, see Light in LightCulling.hpp
+layout(std430, binding = 15) readonly buffer LightShapeBuffer{
+	vec4 data[];
+} lightShapeBuffer;
+
+// global pool of visible light indices, every cluster owns a range of it
+layout(std430, binding = 1) writeonly buffer VisibleLightIndicesBuffer{
+	uint data[];
+} visibleLightIndicesBuffer;
+
+// (offset, count) of the range in the index pool per cluster
+layout(std430, binding = 2) writeonly buffer LightGridBuffer{
+	LightGridCell data[];
+} lightGridBuffer;
+
+// atomic allocator of the index pool, cleared every frame
+layout(std430, binding = 3) buffer LightIndexCounter{
+	uint next;
+} lightIndexCounter;
+
+// debug counters, cleared every frame
+layout(std430, binding = 4) buffer CullingStats{
+	uint depthMaskRejectedLights;
+	uint shadedLights;
+	uint contributingLights;
+	// lights dropped because a list was full or the index pool ran out
+	uint overflowedLights;
+	uint poolOverflowedLights;
+} cullingStats;
+
+// candidate lights per 64x64 pixel super tile from coarse_culling_comp.glsl
+layout(std430, binding = 5) readonly buffer CoarseLightGridBuffer{
+	LightGridCell data[];
+} coarseLightGridBuffer;
+
+layout(std430, binding = 6) readonly buffer CoarseLightIndicesBuffer{
+	uint data[];
+} coarseLightIndicesBuffer;
+
+// number of lights in lightBuffer, written by light_transform_comp.glsl
+layout(std430, binding = 14) readonly buffer ViewLightCount{
+	uint count;
+} viewLightCount;
+
+// uniform
+// linear min/max view depth per tile from depth_reduction_comp.glsl
+uniform sampler2D tileDepthBounds;
+uniform mat4 projection;
+uniform ivec2 screenSize;
+// scan only the candidates of the super tile instead of every light
+uniform bool hierarchicalCulling;
+// size of the index pool in uints
+uniform uint indexPoolSize;
+// two 16 bit indices per uint
+uniform bool packedIndices;
+uniform float near;
+uniform float far;
+
+// default, Window.cpp injects the configured tile size when loading the shader
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+// fine tiles per super tile side, must match coarse_culling_comp.glsl, injected by Window.cpp
+#ifndef SUPER_TILE_TILES
+#define SUPER_TILE_TILES 4
+#endif
+// number of exponential depth slices per tile, must match final_shading_frag.glsl
+#define CLUSTER_SLICES 16
+// default, Window.cpp injects the capacity derived from the light count
+#ifndef MAX_LIGHTS_PER_CLUSTER
+#define MAX_LIGHTS_PER_CLUSTER 128
+#endif
+
+// shared values
+shared vec4 frustumPlanes[4];
+// shared local storage for visible indices of every slice in this tile
+shared uint clusterLightCount[CLUSTER_SLICES];
+shared int clusterLightIndices[CLUSTER_SLICES * MAX_LIGHTS_PER_CLUSTER];
+// range of every slice in the index pool
+shared uint clusterOffset[CLUSTER_SLICES];
+shared uint clusterWords[CLUSTER_SLICES];
+
+// slice k covers view depth [near * (far / near)^(k / S), near * (far / near)^((k + 1) / S)]
+uint depthSlice(float viewDepth)
+{
+	float slice = log(viewDepth / near) * float(CLUSTER_SLICES) / log(far / near);
+	return uint(clamp(slice, 0.0, float(CLUSTER_SLICES - 1)));
+}
+
+// signed distance of the farthest point of the light volume to a normalized plane, outside when <= 0,
+// must match LightPlaneDistance in LightCulling.hpp
+float lightPlaneDistance(vec4 positionAndRadius, vec4 shape, vec4 plane)
+{
+	float center = dot(positionAndRadius.xyz, plane.xyz) + plane.w;
+	float sphere = center + positionAndRadius.w;
+	float axis = dot(shape.xyz, plane.xyz);
+	if(shape.w > 0.0)
+	{
+		// spot cone clipped to the range sphere, the apex or the rim of the base is farthest
+		float range = positionAndRadius.w;
+		float baseRadius = range * sqrt(1.0 - shape.w * shape.w) / shape.w;
+		float base = center + range * axis + baseRadius * sqrt(max(1.0 - axis * axis, 0.0));
+		return min(sphere, max(center, base));
+	}
+	if(shape.w < 0.0)
+	{
+		// capsule, the farther segment end plus the range
+		return center + abs(axis) - shape.w;
+	}
+	return sphere;
+}
+
+// nearest and farthest view depth of a view space light volume
+vec2 lightDepthRange(vec4 positionAndRadius, vec4 shape)
+{
+	return vec2(-lightPlaneDistance(positionAndRadius, shape, vec4(0.0, 0.0, 1.0, 0.0)),
+		lightPlaneDistance(positionAndRadius, shape, vec4(0.0, 0.0, -1.0, 0.0)));
+}
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE, local_size_z = 1) in;
+void main()
+{
+	ivec2 tileID = ivec2(gl_WorkGroupID.xy);
+	ivec2 tileNumber = ivec2(gl_NumWorkGroups.xy);
+	uint index = tileID.y * tileNumber.x + tileID.x;
+
+	// initialize global values
+	if(gl_LocalInvocationIndex < CLUSTER_SLICES)
+	{
+		clusterLightCount[gl_LocalInvocationIndex] = 0;
+	}
+
+	if(gl_LocalInvocationIndex == 0)
+	{
+		vec2 negativeStep = (2.0 * vec2(tileID)) / vec2(tileNumber);
+		vec2 positiveStep = (2.0 * vec2(tileID + ivec2(1, 1))) / vec2(tileNumber);
+
+		// Only the side planes are shared by all slices of the tile
+		frustumPlanes[0] = vec4(1.0, 0.0, 0.0, 1.0 - negativeStep.x); // Left
+		frustumPlanes[1] = vec4(-1.0, 0.0, 0.0, -1.0 + positiveStep.x); // Right
+		frustumPlanes[2] = vec4(0.0, 1.0, 0.0, 1.0 - negativeStep.y); // Bottom
+		frustumPlanes[3] = vec4(0.0, -1.0, 0.0, -1.0 + positiveStep.y); // Top
+
+		// the lights are already in view space
+		for(uint i = 0; i < 4; ++i)
+		{
+			frustumPlanes[i] *= projection;
+			frustumPlanes[i] /= length(frustumPlanes[i].xyz);
+		}
+	}
+
+	barrier();
+
+	// max/min depth of the current tile, slices outside this range stay empty
+	vec2 depthBounds = texelFetch(tileDepthBounds, tileID, 0).rg;
+	float minDepth = depthBounds.x;
+	float maxDepth = depthBounds.y;
+
+	// cull lights, each light is appended to every slice its depth range touches
+	uint candidateCount = viewLightCount.count;
+	uint candidateOffset = 0;
+	if(hierarchicalCulling)
+	{
+		ivec2 superTileID = tileID / SUPER_TILE_TILES;
+		uint superTileIndex = superTileID.y * ((tileNumber.x + SUPER_TILE_TILES - 1) / SUPER_TILE_TILES) + superTileID.x;
+		LightGridCell coarse = coarseLightGridBuffer.data[superTileIndex];
+		candidateCount = coarse.count;
+		candidateOffset = coarse.offset;
+	}
+
+	uint threadCount = TILE_SIZE * TILE_SIZE;
+	uint passCount = (candidateCount + threadCount - 1) / threadCount;
+	for(uint i = 0; i < passCount; ++i)
+	{
+		uint candidate = i * threadCount + gl_LocalInvocationIndex;
+		if(candidate >= candidateCount)
+		{
+			break;
+		}
+		uint lightIndex = hierarchicalCulling ? coarseLightIndicesBuffer.data[candidateOffset + candidate] : candidate;
+
+		vec4 positionAndRadius = lightBuffer.data[lightIndex];
+		vec4 shape = lightShapeBuffer.data[lightIndex];
+
+		// check light exists in tile side planes
+		float distance = 0.0f;
+		for(uint j = 0; j < 4; ++j)
+		{
+			distance = lightPlaneDistance(positionAndRadius, shape, frustumPlanes[j]);
+
+			if(distance <= 0.0)
+			{
+				break;
+			}
+		}
+		if(distance <= 0.0)
+		{
+			continue;
+		}
+
+		// clip the light depth range against the geometry in this tile
+		vec2 lightDepth = lightDepthRange(positionAndRadius, shape);
+		float nearDepth = max(lightDepth.x, minDepth);
+		float farDepth = min(lightDepth.y, maxDepth);
+		if(nearDepth > farDepth)
+		{
+			continue;
+		}
+
+		uint firstSlice = depthSlice(nearDepth);
+		uint lastSlice = depthSlice(farDepth);
+		for(uint slice = firstSlice; slice <= lastSlice; ++slice)
+		{
+			uint offset = atomicAdd(clusterLightCount[slice], 1);
+			if(offset < MAX_LIGHTS_PER_CLUSTER)
+			{
+				clusterLightIndices[slice * MAX_LIGHTS_PER_CLUSTER + offset] = int(lightIndex);
+			}
+		}
+	}
+
+	barrier();
+
+	// allocate a range in the index pool, one thread per slice
+	if(gl_LocalInvocationIndex < CLUSTER_SLICES)
+	{
+		uint slice = gl_LocalInvocationIndex;
+		uint visibleCount = min(clusterLightCount[slice], MAX_LIGHTS_PER_CLUSTER);
+		if(clusterLightCount[slice] > visibleCount)
+		{
+			atomicAdd(cullingStats.overflowedLights, clusterLightCount[slice] - visibleCount);
+		}
+		uint count = visibleCount;
+		uint words = packedIndices ? (count + 1) / 2 : count;
+		uint offset = atomicAdd(lightIndexCounter.next, words);
+
+		// clamp the list if the pool is exhausted
+		uint available = offset < indexPoolSize ? indexPoolSize - offset : 0u;
+		if(words > available)
+		{
+			words = available;
+			uint kept = packedIndices ? words * 2 : words;
+			atomicAdd(cullingStats.poolOverflowedLights, count - kept);
+			count = kept;
+		}
+
+		clusterOffset[slice] = offset;
+		clusterWords[slice] = words;
+		uint cluster = index * CLUSTER_SLICES + slice;
+		lightGridBuffer.data[cluster].offset = offset;
+		lightGridBuffer.data[cluster].count = min(count, visibleCount);
+	}
+
+	barrier();
+
+	// copy result back to global buffer, spread over the whole work group
+	for(uint slice = 0; slice < CLUSTER_SLICES; ++slice)
+	{
+		uint base = slice * MAX_LIGHTS_PER_CLUSTER;
+		uint visibleCount = min(clusterLightCount[slice], MAX_LIGHTS_PER_CLUSTER);
+		for(uint i = gl_LocalInvocationIndex; i < clusterWords[slice]; i += threadCount)
+		{
+			if(packedIndices)
+			{
+				uint low = uint(clusterLightIndices[base + 2 * i]);
+				uint high = 2 * i + 1 < visibleCount ? uint(clusterLightIndices[base + 2 * i + 1]) : 0xFFFFu;
+				visibleLightIndicesBuffer.data[clusterOffset[slice] + i] = low | (high << 16);
+			}
+			else
+			{
+				visibleLightIndicesBuffer.data[clusterOffset[slice] + i] = uint(clusterLightIndices[base + i]);
+			}
+		}
+	}
+}
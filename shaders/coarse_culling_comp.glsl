@@ -0,0 +1,213 @@
+#version 430
+
+struct LightGridCell {
+	uint offset;
+	uint count;
+};
+
+// storage buffer objects
+// view space xyz position, w radius of the lights in the camera frustum from light_transform_comp.glsl
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+// w == 0 point, w > 0 spot with the cosine of the cone angle and xyz direction,
+// w < 0 capsule with minus the range and xyz half segment, see Light in LightCulling.hpp
+layout(std430, binding = 15) readonly buffer LightShapeBuffer{
+	vec4 data[];
+} lightShapeBuffer;
+
+// debug counters, cleared every frame
+layout(std430, binding = 4) buffer CullingStats{
+	uint depthMaskRejectedLights;
+	uint shadedLights;
+	uint contributingLights;
+	// lights dropped because a list was full or the index pool ran out
+	uint overflowedLights;
+	uint poolOverflowedLights;
+} cullingStats;
+
+// (offset, count) of the candidate lights per super tile
+layout(std430, binding = 5) writeonly buffer CoarseLightGridBuffer{
+	LightGridCell data[];
+} coarseLightGridBuffer;
+
+// candidate light indices, MAX_LIGHTS_PER_SUPER_TILE slots per super tile
+layout(std430, binding = 6) writeonly buffer CoarseLightIndicesBuffer{
+	uint data[];
+} coarseLightIndicesBuffer;
+
+// number of lights in lightBuffer, written by light_transform_comp.glsl
+layout(std430, binding = 14) readonly buffer ViewLightCount{
+	uint count;
+} viewLightCount;
+
+// uniform
+// linear min/max view depth per tile from depth_reduction_comp.glsl
+uniform sampler2D tileDepthBounds;
+uniform mat4 projection;
+// number of fine tiles, super tiles at the border may be partial
+uniform ivec2 tileCount;
+
+// default, Window.cpp injects the configured tile size when loading the shader
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+// default, Window.cpp injects the fine tiles per super tile side, 64 pixels over the tile size. At most
+// TILE_SIZE * TILE_SIZE tiles, one per thread
+#ifndef SUPER_TILE_TILES
+#define SUPER_TILE_TILES 4
+#endif
+// default, Window.cpp injects the capacity derived from the light count
+#ifndef MAX_LIGHTS_PER_SUPER_TILE
+#define MAX_LIGHTS_PER_SUPER_TILE 1024
+#endif
+
+// shared values
+shared uint minDepthInt;
+shared uint maxDepthInt;
+shared uint visibleLightCount;
+shared vec4 frustumPlanes[6];
+// shared local storage for visible indices
+shared int visibleLightIndices[MAX_LIGHTS_PER_SUPER_TILE];
+
+// signed distance of the farthest point of the light volume to a normalized plane, outside when <= 0,
+// must match LightPlaneDistance in LightCulling.hpp
+float lightPlaneDistance(vec4 positionAndRadius, vec4 shape, vec4 plane)
+{
+	float center = dot(positionAndRadius.xyz, plane.xyz) + plane.w;
+	float sphere = center + positionAndRadius.w;
+	float axis = dot(shape.xyz, plane.xyz);
+	if(shape.w > 0.0)
+	{
+		// spot cone clipped to the range sphere, the apex or the rim of the base is farthest
+		float range = positionAndRadius.w;
+		float baseRadius = range * sqrt(1.0 - shape.w * shape.w) / shape.w;
+		float base = center + range * axis + baseRadius * sqrt(max(1.0 - axis * axis, 0.0));
+		return min(sphere, max(center, base));
+	}
+	if(shape.w < 0.0)
+	{
+		// capsule, the farther segment end plus the range
+		return center + abs(axis) - shape.w;
+	}
+	return sphere;
+}
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE, local_size_z = 1) in;
+void main()
+{
+	ivec2 superTileID = ivec2(gl_WorkGroupID.xy);
+	ivec2 superTileNumber = ivec2(gl_NumWorkGroups.xy);
+	uint index = superTileID.y * superTileNumber.x + superTileID.x;
+
+	// initialize global values
+	if(gl_LocalInvocationIndex == 0)
+	{
+		minDepthInt = 0xFFFFFFFF;
+		maxDepthInt = 0;
+		visibleLightCount = 0;
+	}
+
+	barrier();
+
+	// merge the depth bounds of the fine tiles, one thread per tile
+	if(gl_LocalInvocationIndex < SUPER_TILE_TILES * SUPER_TILE_TILES)
+	{
+		ivec2 tileID = superTileID * SUPER_TILE_TILES + ivec2(gl_LocalInvocationIndex % SUPER_TILE_TILES, gl_LocalInvocationIndex / SUPER_TILE_TILES);
+		if(all(lessThan(tileID, tileCount)))
+		{
+			vec2 depthBounds = texelFetch(tileDepthBounds, tileID, 0).rg;
+			// positive floats keep their order as uint bits
+			atomicMin(minDepthInt, floatBitsToUint(depthBounds.x));
+			atomicMax(maxDepthInt, floatBitsToUint(depthBounds.y));
+		}
+	}
+
+	barrier();
+
+	if(gl_LocalInvocationIndex == 0)
+	{
+		float minDepth = uintBitsToFloat(minDepthInt);
+		float maxDepth = uintBitsToFloat(maxDepthInt);
+
+		// NDC range of the fine tiles covered by this super tile
+		ivec2 firstTile = superTileID * SUPER_TILE_TILES;
+		ivec2 lastTile = min(firstTile + ivec2(SUPER_TILE_TILES), tileCount);
+		vec2 negativeStep = (2.0 * vec2(firstTile)) / vec2(tileCount);
+		vec2 positiveStep = (2.0 * vec2(lastTile)) / vec2(tileCount);
+
+		// Set up starting values for planes using steps and min and max z values
+		frustumPlanes[0] = vec4(1.0, 0.0, 0.0, 1.0 - negativeStep.x); // Left
+		frustumPlanes[1] = vec4(-1.0, 0.0, 0.0, -1.0 + positiveStep.x); // Right
+		frustumPlanes[2] = vec4(0.0, 1.0, 0.0, 1.0 - negativeStep.y); // Bottom
+		frustumPlanes[3] = vec4(0.0, -1.0, 0.0, -1.0 + positiveStep.y); // Top
+		frustumPlanes[4] = vec4(0.0, 0.0, -1.0, -minDepth); // Near
+		frustumPlanes[5] = vec4(0.0, 0.0, 1.0, maxDepth); // Far
+
+		// Transform the first four planes, the lights are already in view space
+		for(uint i = 0; i < 4; ++i)
+		{
+			frustumPlanes[i] *= projection;
+			frustumPlanes[i] /= length(frustumPlanes[i].xyz);
+		}
+	}
+
+	barrier();
+
+	// cull lights against the super tile, the fine pass only scans the survivors
+	uint threadCount = TILE_SIZE * TILE_SIZE;
+	uint lightCount = viewLightCount.count;
+	uint passCount = (lightCount + threadCount - 1) / threadCount;
+	for(uint i = 0; i < passCount; ++i)
+	{
+		uint lightIndex = i * threadCount + gl_LocalInvocationIndex;
+		if(lightIndex >= lightCount)
+		{
+			break;
+		}
+
+		vec4 positionAndRadius = lightBuffer.data[lightIndex];
+		vec4 shape = lightShapeBuffer.data[lightIndex];
+
+		// check light exists in frustum
+		float distance = 0.0f;
+		for(uint j = 0; j < 6; ++j)
+		{
+			distance = lightPlaneDistance(positionAndRadius, shape, frustumPlanes[j]);
+
+			if(distance <= 0.0)
+			{
+				break;
+			}
+		}
+		if(distance > 0.0)
+		{
+			uint offset = atomicAdd(visibleLightCount, 1);
+			if(offset < MAX_LIGHTS_PER_SUPER_TILE)
+			{
+				visibleLightIndices[offset] = int(lightIndex);
+			}
+		}
+	}
+
+	barrier();
+
+	// copy result back to global buffer, spread over the whole work group
+	uint count = min(visibleLightCount, MAX_LIGHTS_PER_SUPER_TILE);
+	uint offset = index * MAX_LIGHTS_PER_SUPER_TILE;
+	if(gl_LocalInvocationIndex == 0 && visibleLightCount > count)
+	{
+		atomicAdd(cullingStats.overflowedLights, visibleLightCount - count);
+	}
+	for(uint i = gl_LocalInvocationIndex; i < count; i += threadCount)
+	{
+		coarseLightIndicesBuffer.data[offset + i] = uint(visibleLightIndices[i]);
+	}
+
+	if(gl_LocalInvocationIndex == 0)
+	{
+		coarseLightGridBuffer.data[index].offset = offset;
+		coarseLightGridBuffer.data[index].count = count;
+	}
+}
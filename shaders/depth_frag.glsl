@@ -1,6 +1,49 @@
-#version 330 core
+#version 430
+#ifdef BINDLESS_TEXTURES
+#extension GL_ARB_bindless_texture : require
+#endif
+
+in VERTEX_OUT {
+    vec2 texCoords;
+    flat uint materialId;
+} fragment_in;
+
+// see final_shading_frag.glsl
+struct MaterialTextures {
+    uvec2 diffuse;
+    uvec2 specular;
+    uvec2 normal;
+};
+
+layout(std430, binding = 30) readonly buffer MaterialBuffer {
+    MaterialTextures data[];
+} materialBuffer;
+
+// must match Model::MAX_TEXTURE_ARRAYS
+#define MAX_TEXTURE_ARRAYS 8
+uniform sampler2DArray textureArrays[MAX_TEXTURE_ARRAYS];
+
+float diffuseAlpha(uvec2 location, vec2 texCoords)
+{
+#ifdef BINDLESS_TEXTURES
+    return texture(sampler2D(location), texCoords).a;
+#else
+    for(int i = 0; i < MAX_TEXTURE_ARRAYS; ++i)
+    {
+        if(uint(i) == location.x)
+        {
+            return texture(textureArrays[i], vec3(texCoords, float(location.y))).a;
+        }
+    }
+    return 1.0;
+#endif
+}
 
 void main()
 {
-    
+    // the same cutout as the final pass, which only shades the depth written here
+    if(diffuseAlpha(materialBuffer.data[fragment_in.materialId].diffuse, fragment_in.texCoords) <= 0.2)
+    {
+        discard;
+    }
 }
@@ -0,0 +1,47 @@
+#version 430
+
+// One level of the min/max depth pyramid, the nearest and farthest depth of every 2x2 texels of the level
+// below, level 0 from the depth map. Texel x of level n covers the pixels [x, x + 1) * 2^(n + 1), the pyramid
+// is padded to a power of two and the pixels past the screen read as the cleared depth. Built once after the
+// prepass for the tile bounds of light culling and the occlusion test of mesh culling
+
+// uniform
+uniform sampler2D depthMap;
+uniform ivec2 screenSize;
+// reduce the depth map instead of sourceLevel
+uniform bool firstLevel;
+
+// min depth in r, max depth in g
+layout(rg32f, binding = 0) uniform readonly image2D sourceLevel;
+layout(rg32f, binding = 1) uniform writeonly image2D pyramidLevel;
+
+#define GROUP_SIZE 8
+
+vec2 sourceDepth(ivec2 texel)
+{
+	if(firstLevel)
+	{
+		return vec2(all(lessThan(texel, screenSize)) ? texelFetch(depthMap, texel, 0).r : 1.0);
+	}
+	// the levels where one side is already a single texel keep reading it
+	return imageLoad(sourceLevel, min(texel, imageSize(sourceLevel) - 1)).rg;
+}
+
+layout(local_size_x = GROUP_SIZE, local_size_y = GROUP_SIZE, local_size_z = 1) in;
+void main()
+{
+	ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+	if(any(greaterThanEqual(texel, imageSize(pyramidLevel))))
+	{
+		return;
+	}
+
+	ivec2 source = texel * 2;
+	vec2 depth = sourceDepth(source);
+	for(int i = 1; i < 4; ++i)
+	{
+		vec2 neighbor = sourceDepth(source + ivec2(i & 1, i >> 1));
+		depth = vec2(min(depth.x, neighbor.x), max(depth.y, neighbor.y));
+	}
+	imageStore(pyramidLevel, texel, vec4(depth, 0.0, 0.0));
+}
@@ -0,0 +1,93 @@
+#version 430
+#extension GL_KHR_shader_subgroup_basic : enable
+#extension GL_KHR_shader_subgroup_arithmetic : enable
+
+// Per tile depth of the light culling passes from the depth pyramid, one stage per define:
+//   TILE_DEPTH_MASK  32 bin occupancy of every tile, one thread per pixel, for 2.5D culling
+//   default          linear min/max depth of every tile, one thread per tile
+
+// uniform
+uniform sampler2D depthMap;
+// min/max depth per texel, see depth_pyramid_comp.glsl
+uniform sampler2D depthPyramid;
+uniform mat4 projection;
+uniform ivec2 screenSize;
+uniform ivec2 tileCount;
+
+// linear min/max view depth per tile, read by the light culling passes
+layout(rg32f, binding = 0) uniform writeonly image2D tileDepthBounds;
+// 32 bin occupancy of [min, max] depth per tile for 2.5D culling
+layout(r32ui, binding = 1) uniform writeonly uimage2D tileDepthMask;
+
+// default, Window.cpp injects the configured tile size when loading the shader
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+#define DEPTH_MASK_BINS 32
+
+float linearDepth(float depth)
+{
+	return (0.5 * projection[3][2]) / (0.5 * projection[2][2] + depth - 0.5);
+}
+
+// the texels of pyramid level n cover 2^(n + 1) pixels, so the tiles are the texels of this level
+vec2 tileDepthRange(ivec2 tileID)
+{
+	vec2 depthRange = texelFetch(depthPyramid, tileID, findMSB(TILE_SIZE) - 1).rg;
+	return vec2(linearDepth(depthRange.x), linearDepth(depthRange.y));
+}
+
+#if defined(TILE_DEPTH_MASK)
+// tile results shared with every thread
+shared vec2 tileDepthBoundsShared;
+shared uint tileDepthMaskBits;
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE, local_size_z = 1) in;
+void main()
+{
+	ivec2 location = ivec2(gl_GlobalInvocationID.xy);
+	ivec2 tileID = ivec2(gl_WorkGroupID.xy);
+
+	if(gl_LocalInvocationIndex == 0)
+	{
+		tileDepthBoundsShared = tileDepthRange(tileID);
+		tileDepthMaskBits = 0;
+	}
+
+	barrier();
+
+	vec2 text = vec2(location) / screenSize;
+	float depth = linearDepth(texture(depthMap, text).r);
+
+	// mark the depth bin of every pixel as occupied
+	float binScale = float(DEPTH_MASK_BINS) / max(tileDepthBoundsShared.y - tileDepthBoundsShared.x, 1e-6);
+	uint bin = uint(clamp((depth - tileDepthBoundsShared.x) * binScale, 0.0, float(DEPTH_MASK_BINS - 1)));
+#if defined(GL_KHR_shader_subgroup_arithmetic)
+	uint bits = subgroupOr(1u << bin);
+	if(subgroupElect())
+	{
+		atomicOr(tileDepthMaskBits, bits);
+	}
+#else
+	atomicOr(tileDepthMaskBits, 1u << bin);
+#endif
+
+	barrier();
+
+	if(gl_LocalInvocationIndex == 0)
+	{
+		imageStore(tileDepthMask, tileID, uvec4(tileDepthMaskBits, 0, 0, 0));
+	}
+}
+#else
+layout(local_size_x = 8, local_size_y = 8, local_size_z = 1) in;
+void main()
+{
+	ivec2 tileID = ivec2(gl_GlobalInvocationID.xy);
+	if(any(greaterThanEqual(tileID, tileCount)))
+	{
+		return;
+	}
+	imageStore(tileDepthBounds, tileID, vec4(tileDepthRange(tileID), 0.0, 0.0));
+}
+#endif
@@ -1,6 +1,17 @@
 #version 330 core
 
 layout (location = 0) in vec3 position;
+layout (location = 2) in vec2 texCoords;
+// material of the draw for the alpha test, see final_shading_vert.glsl
+layout (location = 5) in uint materialId;
+
+// the final pass tests its depth for equality against this pass, both compute the position the same way
+invariant gl_Position;
+
+out VERTEX_OUT {
+    vec2 texCoords;
+    flat uint materialId;
+} vertex_out;
 
 uniform mat4 projection;
 uniform mat4 view;
@@ -8,5 +19,8 @@ uniform mat4 model;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0);
+    vec4 viewSpacePosition = view * model * vec4(position, 1.0);
+    gl_Position = projection * viewSpacePosition;
+    vertex_out.texCoords = texCoords;
+    vertex_out.materialId = materialId;
 }
@@ -1,35 +1,140 @@
 #version 430
+#ifdef BINDLESS_TEXTURES
+#extension GL_ARB_bindless_texture : require
+#endif
+
+// the depth is final after the prepass, which already cut out the transparent texels, so only the visible
+// fragment of every pixel passes the equal test and is shaded. Forced early since the stats counters are
+// side effects that would otherwise keep the test after the shader
+layout(early_fragment_tests) in;
 
 in VERTEX_OUT {
-    vec3 worldPosition;
+    vec3 viewSpacePosition;
     vec2 texCoords;
     mat3 TBN;
-    vec3 tangentViewPosition;
-    vec3 tangentWorldPosition;
+    flat uint materialId;
 } fragment_in;
 
-struct PointLight {
-    vec4 color;
-    vec4 position;
-    vec4 paddingAndRadius;
+struct LightGridCell {
+    uint offset;
+    uint count;
 };
 
-struct VisibleIndex{
-    int index;
+// first and last depth sorted light overlapping a depth bin, empty when first > last
+struct ZBin {
+    uint first;
+    uint last;
 };
 
+// view space xyz position, w radius from light_transform_comp.glsl
 layout(std430, binding = 0) readonly buffer LightBuffer {
-    PointLight data[];
+    vec4 data[];
 } lightBuffer;
 
+// RGBA as four half floats, same order as lightBuffer
+layout(std430, binding = 10) readonly buffer LightColorBuffer {
+    uvec2 data[];
+} lightColorBuffer;
+
+// w == 0 point, w > 0 spot with the cosine of the cone angle and xyz direction,
+// w < 0 capsule with minus the range and xyz half segment, see Light in LightCulling.hpp
+layout(std430, binding = 15) readonly buffer LightShapeBuffer {
+    vec4 data[];
+} lightShapeBuffer;
+
 layout(std430, binding = 1) readonly buffer VisibleLightIndicesBuffer {
-    VisibleIndex data[];
+    uint data[];
 } visibleLightIndicesBuffer;
 
-uniform sampler2D texture_diffuse1;
-uniform sampler2D texture_specular1;
-uniform sampler2D texture_normal1;
+layout(std430, binding = 2) readonly buffer LightGridBuffer {
+    LightGridCell data[];
+} lightGridBuffer;
+
+// one bit per depth sorted light per tile from zbin_culling_comp.glsl
+layout(std430, binding = 7) readonly buffer TileLightMaskBuffer {
+    uint data[];
+} tileLightMaskBuffer;
+
+// light range per depth bin from zbin_sort_comp.glsl
+layout(std430, binding = 8) readonly buffer ZBinBuffer {
+    ZBin data[];
+} zBinBuffer;
+
+// view lights and per tile lists of the dynamic lights while the static light grid is on, culled on their
+// own so the lists above stay valid while they move
+layout(std430, binding = 35) readonly buffer DynamicLightBuffer {
+    vec4 data[];
+} dynamicLightBuffer;
+
+layout(std430, binding = 36) readonly buffer DynamicLightColorBuffer {
+    uvec2 data[];
+} dynamicLightColorBuffer;
+
+layout(std430, binding = 37) readonly buffer DynamicLightShapeBuffer {
+    vec4 data[];
+} dynamicLightShapeBuffer;
+
+layout(std430, binding = 38) readonly buffer DynamicLightIndicesBuffer {
+    uint data[];
+} dynamicLightIndicesBuffer;
+
+layout(std430, binding = 39) readonly buffer DynamicLightGridBuffer {
+    LightGridCell data[];
+} dynamicLightGridBuffer;
+
+// debug counters shared with light_culling_comp.glsl
+layout(std430, binding = 4) buffer CullingStats {
+    uint depthMaskRejectedLights;
+    uint shadedLights;
+    uint contributingLights;
+    uint overflowedLights;
+    uint poolOverflowedLights;
+} cullingStats;
+
+// texture of every material slot, the halves of a bindless handle or the texture array and layer,
+// see MaterialTextures in Model.hpp
+struct MaterialTextures {
+    uvec2 diffuse;
+    uvec2 specular;
+    uvec2 normal;
+};
+
+layout(std430, binding = 30) readonly buffer MaterialBuffer {
+    MaterialTextures data[];
+} materialBuffer;
+
+// must match Model::MAX_TEXTURE_ARRAYS
+#define MAX_TEXTURE_ARRAYS 8
+// one array per texture size when bindless textures are not available
+uniform sampler2DArray textureArrays[MAX_TEXTURE_ARRAYS];
 uniform int numberOfTilesX;
+uniform int cullingMode;
+uniform bool packedIndices;
+// uints per tile in the tile light mask
+uniform uint lightWords;
+// count culled lights that end up with zero attenuation
+uniform bool collectLightStats;
+// shade the dynamic light lists as well
+uniform bool dynamicLightLists;
+uniform float near;
+uniform float far;
+
+// must match CullingMode in Window.h
+#define TILED 0
+#define CLUSTERED 1
+#define ZBINNED 2
+#define BVH 3
+
+// must match cluster_culling_comp.glsl
+#define CLUSTER_SLICES 16
+// default, Window.cpp injects the configured tile size when loading the shader
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+// must match Z_BINS in Window.cpp
+#define Z_BINS 64
+// share of the spot cone cosine range over which the edge fades out
+#define SPOT_EDGE_SOFTNESS 0.1
 
 out vec4 fragColor; 
 
@@ -43,68 +148,179 @@ float attenuate(vec3 lightDirection, float radius)
     return clamp(attenuation, 0.0, 1.0);
 }
 
+// texture of a material slot, the material is the same for the whole draw so the selected array is too
+vec4 sampleMaterial(uvec2 location, vec2 texCoords)
+{
+#ifdef BINDLESS_TEXTURES
+    return texture(sampler2D(location), texCoords);
+#else
+    for(int i = 0; i < MAX_TEXTURE_ARRAYS; ++i)
+    {
+        if(uint(i) == location.x)
+        {
+            return texture(textureArrays[i], vec3(texCoords, float(location.y)));
+        }
+    }
+    return vec4(1.0);
+#endif
+}
+
+// i-th light index of a range in the index pool
+uint lightIndexAt(uint offset, uint i)
+{
+    if(packedIndices)
+    {
+        uint word = visibleLightIndicesBuffer.data[offset + i / 2];
+        return (word >> ((i & 1u) * 16u)) & 0xFFFFu;
+    }
+    return visibleLightIndicesBuffer.data[offset + i];
+}
+
+// linear view depth from window depth
+float linearDepth(float depth)
+{
+    float z = depth * 2.0 - 1.0; // back to NDC
+    return (2.0 * near * far) / (far + near - z * (far - near));
+}
+
+// same exponential slicing as cluster_culling_comp.glsl, also used for the Z bins
+uint depthSlice(float viewDepth, uint sliceCount)
+{
+    float slice = log(viewDepth / near) * float(sliceCount) / log(far / near);
+    return uint(clamp(slice, 0.0, float(sliceCount - 1)));
+}
+
+vec3 shadeLight(vec4 positionAndRadius, vec4 shape, uvec2 packedColor, vec3 normal, vec3 viewDirection, vec4 base_diffuse, vec4 base_specular, inout uint contributingLights)
+{
+    vec4 lightColor = vec4(unpackHalf2x16(packedColor.x), unpackHalf2x16(packedColor.y));
+    //lightColor = vec4(1.0, 1.0, 1.0, 1.0);
+
+    // selects instead of a branch per type: point lights are capsules without a segment,
+    // spot lights are point lights with a cone factor
+    bool capsule = shape.w < 0.0;
+    vec3 halfAxis = capsule ? shape.xyz : vec3(0.0);
+    float lightRadius = capsule ? -shape.w : positionAndRadius.w;
+
+    // light from the closest point of the segment
+    vec3 lightPosition = positionAndRadius.xyz;
+    float t = dot(fragment_in.viewSpacePosition - lightPosition, halfAxis) / max(dot(halfAxis, halfAxis), 1e-8);
+    lightPosition += halfAxis * clamp(t, -1.0, 1.0);
+
+    // Calculate the light attenuation on the pre-normalized lightDirection
+    vec3 lightDirection = lightPosition - fragment_in.viewSpacePosition;
+    float attenuation = attenuate(lightDirection, lightRadius);
+
+    // Normalize the light direction and fade out at the spot cone edge
+    lightDirection = normalize(lightDirection);
+    float spotCos = dot(-lightDirection, shape.xyz);
+    attenuation *= shape.w > 0.0 ? smoothstep(shape.w, mix(shape.w, 1.0, SPOT_EDGE_SOFTNESS), spotCos) : 1.0;
+    if(attenuation > 0.0)
+    {
+        ++contributingLights;
+    }
+
+    // calculate the halfway vector
+    vec3 halfway = normalize(lightDirection + viewDirection);
+
+    // shading model
+    vec3 irradiance = vec3(0.0);
+    float diffuse = dot(lightDirection, normal);
+    if(diffuse > 0.0)
+    {
+        irradiance = base_diffuse.rgb * diffuse;
+        float specular = dot(normal, halfway);
+        if(specular > 0.0)
+        {
+            specular = pow(specular, 32.0);
+            irradiance += base_specular.rgb * specular;
+        }
+        irradiance *= lightColor.rgb * attenuation;
+    }
+    return irradiance;
+}
+
+vec3 shadeViewLight(uint lightIndex, vec3 normal, vec3 viewDirection, vec4 base_diffuse, vec4 base_specular, inout uint contributingLights)
+{
+    return shadeLight(lightBuffer.data[lightIndex], lightShapeBuffer.data[lightIndex], lightColorBuffer.data[lightIndex],
+        normal, viewDirection, base_diffuse, base_specular, contributingLights);
+}
+
 void main()
 {
     ivec2 location = ivec2(gl_FragCoord.xy);
-    ivec2 tileID = location / ivec2(16, 16);
+    ivec2 tileID = location / ivec2(TILE_SIZE, TILE_SIZE);
     uint index = tileID.y * numberOfTilesX + tileID.x;
 
     // extract texture values
-    vec4 base_diffuse = texture(texture_diffuse1, fragment_in.texCoords);
-    vec4 base_specular = texture(texture_specular1, fragment_in.texCoords);
-    vec3 normal = texture(texture_normal1, fragment_in.texCoords).rgb;
-    normal = normalize(normal * 2.0 - 1.0);
+    MaterialTextures material = materialBuffer.data[fragment_in.materialId];
+    vec4 base_diffuse = sampleMaterial(material.diffuse, fragment_in.texCoords);
+    vec4 base_specular = sampleMaterial(material.specular, fragment_in.texCoords);
+    vec3 normal = sampleMaterial(material.normal, fragment_in.texCoords).rgb;
+    normal = normalize(fragment_in.TBN * (normal * 2.0 - 1.0));
     vec4 color = vec4(0.0, 0.0, 0.0, 1.0);
 
-    vec3 viewDirection = normalize(fragment_in.tangentViewPosition - fragment_in.tangentWorldPosition);
-    // traverse all visible light in this tile
-    uint offset = index * 1024;
-    for(uint i = 0; i < 1024 && visibleLightIndicesBuffer.data[offset + i].index != -1; ++i)
+    // the camera sits at the view space origin
+    vec3 viewDirection = normalize(-fragment_in.viewSpacePosition);
+    float viewDepth = linearDepth(gl_FragCoord.z);
+    uint shadedLights = 0;
+    uint contributingLights = 0;
+    if(cullingMode == ZBINNED)
     {
-        uint lightIndex = visibleLightIndicesBuffer.data[offset + i].index;
-        PointLight light = lightBuffer.data[lightIndex];
-
-        vec4 lightColor = light.color;
-        //lightColor = vec4(1.0, 1.0, 1.0, 1.0);
-        vec3 tangentLightPosition = fragment_in.TBN * light.position.xyz;
-        float lightRadius = light.paddingAndRadius.w;
-
-		// Calculate the light attenuation on the pre-normalized lightDirection
-		vec3 lightDirection = tangentLightPosition - fragment_in.tangentWorldPosition;
-		float attenuation = attenuate(lightDirection, lightRadius);
-
-		// Normalize the light direction and calculate the halfway vector
-		lightDirection = normalize(lightDirection);
-		vec3 halfway = normalize(lightDirection + viewDirection);
-
-        // shading model
-        float diffuse = dot(lightDirection, normal);
-        if(diffuse > 0.0)
+        // lights visible in this tile and overlapping the depth bin of this fragment
+        ZBin zBin = zBinBuffer.data[depthSlice(viewDepth, Z_BINS)];
+        uint offset = index * lightWords;
+        for(uint word = zBin.first / 32; zBin.first <= zBin.last && word <= zBin.last / 32; ++word)
         {
-            vec3 irradiance = base_diffuse.rgb * diffuse;
-            float specular = dot(normal, halfway);
-            if(specular > 0.0)
+            uint mask = tileLightMaskBuffer.data[offset + word];
+            // clip the word to [first, last]
+            if(word == zBin.first / 32)
+            {
+                mask &= 0xFFFFFFFFu << (zBin.first % 32);
+            }
+            if(word == zBin.last / 32)
             {
-                specular = pow(specular, 32.0);
-                irradiance += base_specular.rgb * specular;
+                mask &= 0xFFFFFFFFu >> (31u - zBin.last % 32);
+            }
+            while(mask != 0)
+            {
+                uint bit = uint(findLSB(mask));
+                mask &= mask - 1;
+                color.rgb += shadeViewLight(word * 32 + bit, normal, viewDirection, base_diffuse, base_specular, contributingLights);
+                ++shadedLights;
             }
-            irradiance *= lightColor.rgb * attenuation;
-            color.rgb += irradiance;
         }
     }
+    else
+    {
+        // traverse all visible light in this tile, or in this cluster of the tile, the BVH mode fills the
+        // same per tile lists as the tiled mode
+        uint cell = cullingMode == CLUSTERED ? index * CLUSTER_SLICES + depthSlice(viewDepth, CLUSTER_SLICES) : index;
+        LightGridCell grid = lightGridBuffer.data[cell];
+        for(uint i = 0; i < grid.count; ++i)
+        {
+            color.rgb += shadeViewLight(lightIndexAt(grid.offset, i), normal, viewDirection, base_diffuse, base_specular, contributingLights);
+        }
+        shadedLights = grid.count;
+    }
+    if(dynamicLightLists)
+    {
+        LightGridCell grid = dynamicLightGridBuffer.data[index];
+        for(uint i = 0; i < grid.count; ++i)
+        {
+            uint lightIndex = dynamicLightIndicesBuffer.data[grid.offset + i];
+            color.rgb += shadeLight(dynamicLightBuffer.data[lightIndex], dynamicLightShapeBuffer.data[lightIndex], dynamicLightColorBuffer.data[lightIndex],
+                normal, viewDirection, base_diffuse, base_specular, contributingLights);
+        }
+        shadedLights += grid.count;
+    }
     // environment light
     color.rgb += base_diffuse.rgb * 0.08;
 
-    // remove transparent fragment
-    if(base_diffuse.a <= 0.2)
+    if(collectLightStats)
     {
-        discard;
+        atomicAdd(cullingStats.shadedLights, shadedLights);
+        atomicAdd(cullingStats.contributingLights, contributingLights);
     }
 
     fragColor = color;
-        
-
-
-        
-    
 }
@@ -5,35 +5,38 @@ layout (location = 1) in vec3 normal;
 layout (location = 2) in vec2 texCoords;
 layout (location = 3) in vec3 tangent;
 layout (location = 4) in vec3 bitangent;
+// material of the draw, per instance through the base instance of the indirect command
+layout (location = 5) in uint materialId;
 
+// must match depth_vert.glsl, the depth test of this pass is for equality with the prepass
+invariant gl_Position;
+
+// shading happens in view space, the space of the light list
 out VERTEX_OUT {
-    vec3 worldPosition;
+    vec3 viewSpacePosition;
     vec2 texCoords;
     mat3 TBN;
-    vec3 tangentViewPosition;
-    vec3 tangentWorldPosition;
+    flat uint materialId;
 } vertex_out;
 
 // Uniforms
 uniform mat4 projection;
 uniform mat4 view;
 uniform mat4 model;
-uniform vec3 viewPosition;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0);
-    vertex_out.worldPosition = vec3(model * vec4(position, 1.0));
+    vec4 viewSpacePosition = view * model * vec4(position, 1.0);
+    gl_Position = projection * viewSpacePosition;
+    vertex_out.viewSpacePosition = viewSpacePosition.xyz;
     vertex_out.texCoords = texCoords;
+    vertex_out.materialId = materialId;
 
     mat3 normalTrans = transpose(inverse(mat3(model)));
     vec3 tan = normalize(normalTrans * tangent);
     vec3 bitan = normalize(normalTrans * bitangent);
     vec3 norm = normalize(normalTrans * normal);
 
-    // normal mapping
-    mat3 TBN = transpose(mat3(tan, bitan, norm));
-    vertex_out.tangentViewPosition = TBN * viewPosition;
-    vertex_out.tangentWorldPosition = TBN * vertex_out.worldPosition;
-    vertex_out.TBN = TBN;
+    // normal mapping, tangent space to view space
+    vertex_out.TBN = mat3(view) * mat3(tan, bitan, norm);
 }
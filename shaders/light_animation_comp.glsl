@@ -0,0 +1,41 @@
+#version 430
+
+// storage buffer objects
+// light positions and radii culled and shaded in the last frame, colors never move
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+// light positions and radii of the next frame, swapped in as the light buffer afterwards
+layout (std430, binding = 9) writeonly buffer AnimatedLightBuffer {
+	vec4 data[];
+} animatedLightBuffer;
+
+// uniform
+uniform int lightCount;
+// lights before it are static and keep their position
+uniform int firstLight;
+// vertical step per update
+uniform float lightStep;
+uniform vec3 lightMinBounds;
+uniform vec3 lightMaxBounds;
+
+#define GROUP_SIZE 256
+
+layout(local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint lightIndex = firstLight + gl_GlobalInvocationID.x;
+	if(lightIndex >= lightCount)
+	{
+		return;
+	}
+
+	vec4 positionAndRadius = lightBuffer.data[lightIndex];
+
+	// fall through the light volume and wrap around at the bottom
+	float height = lightMaxBounds.y - lightMinBounds.y;
+	positionAndRadius.y = mod(positionAndRadius.y + lightStep - lightMinBounds.y, height) + lightMinBounds.y;
+
+	animatedLightBuffer.data[lightIndex] = positionAndRadius;
+}
@@ -0,0 +1,235 @@
+#version 430
+
+// Builds a linear BVH over the view lights every frame, one stage per define:
+//   MORTON_CODES   Morton code of every view light center, sorted by radix_sort_comp.glsl afterwards
+//   BVH_NODES      the n - 1 internal nodes of the sorted codes, Karras 2012
+//   default        node bounds from the leaves up and the lights copied into Morton order
+
+struct BvhNode {
+	vec3 aabbMin;
+	// child index, LEAF_NODE set for a light
+	uint left;
+	vec3 aabbMax;
+	uint right;
+};
+
+// storage buffer objects
+// view space xyz position, w radius of the lights in the camera frustum from light_transform_comp.glsl
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+layout (std430, binding = 10) readonly buffer LightColorBuffer {
+	uvec2 data[];
+} lightColorBuffer;
+
+layout (std430, binding = 15) readonly buffer LightShapeBuffer {
+	vec4 data[];
+} lightShapeBuffer;
+
+layout (std430, binding = 13) readonly buffer LightSourceBuffer {
+	uint data[];
+} lightSourceBuffer;
+
+// number of view lights
+layout (std430, binding = 14) readonly buffer ViewLightCount {
+	uint count;
+} viewLightCount;
+
+// Morton codes and the view light of each, sorted after the first stage
+layout (std430, binding = 22) buffer MortonKeyBuffer {
+	uint data[];
+} mortonKeyBuffer;
+
+layout (std430, binding = 23) buffer MortonValueBuffer {
+	uint data[];
+} mortonValueBuffer;
+
+// internal nodes, the root is node 0
+layout (std430, binding = 27) coherent buffer BvhNodeBuffer {
+	BvhNode data[];
+} bvhNodeBuffer;
+
+// parent of the internal nodes, then of the leaves from n - 1 on
+layout (std430, binding = 28) buffer BvhParentBuffer {
+	uint data[];
+} bvhParentBuffer;
+
+// children with their bounds done per internal node, cleared every frame
+layout (std430, binding = 29) buffer BvhVisitBuffer {
+	uint data[];
+} bvhVisitBuffer;
+
+// the view lights in Morton order, read by bvh_culling_comp.glsl and the final pass
+layout (std430, binding = 11) writeonly buffer SortedLightBuffer {
+	vec4 data[];
+} sortedLightBuffer;
+
+layout (std430, binding = 12) writeonly buffer SortedLightColorBuffer {
+	uvec2 data[];
+} sortedLightColorBuffer;
+
+layout (std430, binding = 16) writeonly buffer SortedLightShapeBuffer {
+	vec4 data[];
+} sortedLightShapeBuffer;
+
+layout (std430, binding = 18) writeonly buffer SortedLightSourceBuffer {
+	uint data[];
+} sortedLightSourceBuffer;
+
+// uniform
+// view space box the codes are quantized in, the camera frustum
+uniform vec3 boundsMin;
+uniform vec3 boundsMax;
+
+#define GROUP_SIZE 256
+// must match bvh_culling_comp.glsl
+#define LEAF_NODE 0x80000000u
+
+// spreads the low 10 bits to every third bit
+uint expandBits(uint value)
+{
+	value = (value * 0x00010001u) & 0xFF0000FFu;
+	value = (value * 0x00000101u) & 0x0F00F00Fu;
+	value = (value * 0x00000011u) & 0xC30C30C3u;
+	value = (value * 0x00000005u) & 0x49249249u;
+	return value;
+}
+
+// common prefix length of the sorted codes at i and j, equal codes are told apart by their index
+int commonPrefix(int i, int j, int count)
+{
+	if(j < 0 || j >= count)
+	{
+		return -1;
+	}
+	uint a = mortonKeyBuffer.data[i];
+	uint b = mortonKeyBuffer.data[j];
+	if(a == b)
+	{
+		return 32 + 31 - findMSB(uint(i ^ j));
+	}
+	return 31 - findMSB(a ^ b);
+}
+
+// view space box of the bounding sphere of a leaf, every light type fits in it
+void leafBounds(uint leaf, out vec3 aabbMin, out vec3 aabbMax)
+{
+	vec4 positionAndRadius = lightBuffer.data[mortonValueBuffer.data[leaf]];
+	aabbMin = positionAndRadius.xyz - positionAndRadius.w;
+	aabbMax = positionAndRadius.xyz + positionAndRadius.w;
+}
+
+void childBounds(uint child, out vec3 aabbMin, out vec3 aabbMax)
+{
+	if((child & LEAF_NODE) != 0)
+	{
+		leafBounds(child & ~LEAF_NODE, aabbMin, aabbMax);
+	}
+	else
+	{
+		aabbMin = bvhNodeBuffer.data[child].aabbMin;
+		aabbMax = bvhNodeBuffer.data[child].aabbMax;
+	}
+}
+
+layout(local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	int count = int(viewLightCount.count);
+	int index = int(gl_GlobalInvocationID.x);
+
+#if defined(MORTON_CODES)
+	if(index >= count)
+	{
+		return;
+	}
+	vec3 position = clamp((lightBuffer.data[index].xyz - boundsMin) / (boundsMax - boundsMin), 0.0, 1.0);
+	uvec3 cell = uvec3(position * 1023.0);
+	mortonKeyBuffer.data[index] = (expandBits(cell.x) << 2) | (expandBits(cell.y) << 1) | expandBits(cell.z);
+	mortonValueBuffer.data[index] = uint(index);
+#elif defined(BVH_NODES)
+	if(index >= count - 1)
+	{
+		return;
+	}
+	// direction of the range of the node, towards the neighbor sharing the longer prefix
+	int direction = commonPrefix(index, index + 1, count) - commonPrefix(index, index - 1, count) >= 0 ? 1 : -1;
+	int minPrefix = commonPrefix(index, index - direction, count);
+
+	// other end of the range, an exponential then a binary search
+	int maxLength = 2;
+	while(commonPrefix(index, index + maxLength * direction, count) > minPrefix)
+	{
+		maxLength *= 2;
+	}
+	int rangeLength = 0;
+	for(int stride = maxLength / 2; stride >= 1; stride /= 2)
+	{
+		if(commonPrefix(index, index + (rangeLength + stride) * direction, count) > minPrefix)
+		{
+			rangeLength += stride;
+		}
+	}
+	int other = index + rangeLength * direction;
+
+	// split where the prefix of the range ends
+	int nodePrefix = commonPrefix(index, other, count);
+	int split = 0;
+	int divisor = 2;
+	int stride;
+	do
+	{
+		stride = (rangeLength + divisor - 1) / divisor;
+		if(commonPrefix(index, index + (split + stride) * direction, count) > nodePrefix)
+		{
+			split += stride;
+		}
+		divisor *= 2;
+	} while(stride > 1);
+	int gamma = index + split * direction + min(direction, 0);
+
+	uint left = min(index, other) == gamma ? LEAF_NODE | uint(gamma) : uint(gamma);
+	uint right = max(index, other) == gamma + 1 ? LEAF_NODE | uint(gamma + 1) : uint(gamma + 1);
+	bvhNodeBuffer.data[index].left = left;
+	bvhNodeBuffer.data[index].right = right;
+	bvhParentBuffer.data[(left & LEAF_NODE) != 0 ? count - 1 + gamma : gamma] = uint(index);
+	bvhParentBuffer.data[(right & LEAF_NODE) != 0 ? count + gamma : gamma + 1] = uint(index);
+#else
+	if(index >= count)
+	{
+		return;
+	}
+	// copy the light into Morton order, neighboring tiles then read neighboring lights
+	uint viewLight = mortonValueBuffer.data[index];
+	sortedLightBuffer.data[index] = lightBuffer.data[viewLight];
+	sortedLightColorBuffer.data[index] = lightColorBuffer.data[viewLight];
+	sortedLightShapeBuffer.data[index] = lightShapeBuffer.data[viewLight];
+	sortedLightSourceBuffer.data[index] = lightSourceBuffer.data[viewLight];
+	if(count == 1)
+	{
+		return;
+	}
+
+	// walk up, the second child to arrive at a node has both bounds and continues
+	uint node = bvhParentBuffer.data[count - 1 + index];
+	while(true)
+	{
+		memoryBarrierBuffer();
+		if(atomicAdd(bvhVisitBuffer.data[node], 1) == 0)
+		{
+			break;
+		}
+		vec3 leftMin, leftMax, rightMin, rightMax;
+		childBounds(bvhNodeBuffer.data[node].left, leftMin, leftMax);
+		childBounds(bvhNodeBuffer.data[node].right, rightMin, rightMax);
+		bvhNodeBuffer.data[node].aabbMin = min(leftMin, rightMin);
+		bvhNodeBuffer.data[node].aabbMax = max(leftMax, rightMax);
+		if(node == 0)
+		{
+			break;
+		}
+		node = bvhParentBuffer.data[node];
+	}
+#endif
+}
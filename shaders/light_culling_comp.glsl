@@ -1,77 +1,206 @@
 #version 430
 
-struct PointLight {
-	vec4 color;
-	vec4 position;
-	vec4 paddingAndRadius;
-};
-
-struct VisibleIndex {
-	int index;
+struct LightGridCell {
+	uint offset;
+	uint count;
 };
 
 // storage buffer objects
+// view space xyz position, w radius of the lights in the camera frustum from light_transform_comp.glsl,
+// the colors are a separate stream only the final pass reads
 layout (std430, binding = 0) readonly buffer LightBuffer {
-	PointLight data[];
+	vec4 data[];
 } lightBuffer;
 
+// w == 0 point, w > 0 spot with the cosine of the cone angle and xyz direction,
+// w < 0 capsule with minus the range and xyz half segment, see Light in LightCulling.hpp
+layout(std430, binding = 15) readonly buffer LightShapeBuffer{
+	vec4 data[];
+} lightShapeBuffer;
+
+// global pool of visible light indices, every tile owns a range of it
 layout(std430, binding = 1) writeonly buffer VisibleLightIndicesBuffer{
-	VisibleIndex data[];
+	uint data[];
 } visibleLightIndicesBuffer;
 
+// (offset, count) of the range in the index pool per tile
+layout(std430, binding = 2) writeonly buffer LightGridBuffer{
+	LightGridCell data[];
+} lightGridBuffer;
+
+// atomic allocator of the index pool, cleared every frame
+layout(std430, binding = 3) buffer LightIndexCounter{
+	uint next;
+} lightIndexCounter;
+
+// debug counters, cleared every frame
+layout(std430, binding = 4) buffer CullingStats{
+	uint depthMaskRejectedLights;
+	uint shadedLights;
+	uint contributingLights;
+	// lights dropped because a list was full or the index pool ran out
+	uint overflowedLights;
+	uint poolOverflowedLights;
+} cullingStats;
+
+// candidate lights per 64x64 pixel super tile from coarse_culling_comp.glsl
+layout(std430, binding = 5) readonly buffer CoarseLightGridBuffer{
+	LightGridCell data[];
+} coarseLightGridBuffer;
+
+layout(std430, binding = 6) readonly buffer CoarseLightIndicesBuffer{
+	uint data[];
+} coarseLightIndicesBuffer;
+
+// number of lights in lightBuffer, written by light_transform_comp.glsl
+layout(std430, binding = 14) readonly buffer ViewLightCount{
+	uint count;
+} viewLightCount;
+
 // uniform
-uniform sampler2D depthMap;
-uniform mat4 view;
+// linear min/max view depth per tile from depth_reduction_comp.glsl
+uniform sampler2D tileDepthBounds;
+// 32 bin depth occupancy per tile from depth_reduction_comp.glsl
+uniform usampler2D tileDepthMask;
+// reject lights that only cover empty depth bins of the tile
+uniform bool depthMaskCulling;
 uniform mat4 projection;
 uniform ivec2 screenSize;
-uniform int lightCount;
+// scan only the candidates of the super tile instead of every light
+uniform bool hierarchicalCulling;
+// size of the index pool in uints
+uniform uint indexPoolSize;
+// two 16 bit indices per uint
+uniform bool packedIndices;
+
+// defaults, Window.cpp injects the configured values when loading the shader
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+#ifndef MAX_LIGHTS_PER_TILE
+#define MAX_LIGHTS_PER_TILE 1024
+#endif
 
 // shared values
-shared uint minDepthInt;
-shared uint maxDepthInt;
 shared uint visibleLightCount;
+// range of this tile in the index pool
+shared uint tileOffset;
+shared uint tileWords;
 shared vec4 frustumPlanes[6];
+// view space tile bounds for the tighter tests
+shared vec3 tileAabbMin;
+shared vec3 tileAabbMax;
+shared vec3 tileConeDirection;
+shared float tileConeCos;
+shared float tileConeSin;
 // shared local storage for visible indices
-shared int visibleLightIndices[1024];
-shared mat4 viewProjection;
+shared int visibleLightIndices[MAX_LIGHTS_PER_TILE];
+
+// fine tiles per super tile side, must match coarse_culling_comp.glsl, injected by Window.cpp
+#ifndef SUPER_TILE_TILES
+#define SUPER_TILE_TILES 4
+#endif
+#define DEPTH_MASK_BINS 32
+
+// light vs tile test, selected at compile time, must match LightTileTest in Window.h
+#define PLANE_TEST 0	// sphere against the six tile frustum planes
+#define AABB_TEST 1		// sphere against the view space AABB of the tile frustum
+#define CONE_TEST 2		// sphere against the cone around the tile plus the depth range
+// default, Window.cpp injects the selected test when loading the shader
+#ifndef LIGHT_TILE_TEST
+#define LIGHT_TILE_TEST PLANE_TEST
+#endif
+
+// signed distance of the farthest point of the light volume to a normalized plane, outside when <= 0,
+// must match LightPlaneDistance in LightCulling.hpp
+float lightPlaneDistance(vec4 positionAndRadius, vec4 shape, vec4 plane)
+{
+	float center = dot(positionAndRadius.xyz, plane.xyz) + plane.w;
+	float sphere = center + positionAndRadius.w;
+	float axis = dot(shape.xyz, plane.xyz);
+	if(shape.w > 0.0)
+	{
+		// spot cone clipped to the range sphere, the apex or the rim of the base is farthest
+		float range = positionAndRadius.w;
+		float baseRadius = range * sqrt(1.0 - shape.w * shape.w) / shape.w;
+		float base = center + range * axis + baseRadius * sqrt(max(1.0 - axis * axis, 0.0));
+		return min(sphere, max(center, base));
+	}
+	if(shape.w < 0.0)
+	{
+		// capsule, the farther segment end plus the range
+		return center + abs(axis) - shape.w;
+	}
+	return sphere;
+}
+
+// nearest and farthest view depth of a view space light volume
+vec2 lightDepthRange(vec4 positionAndRadius, vec4 shape)
+{
+	return vec2(-lightPlaneDistance(positionAndRadius, shape, vec4(0.0, 0.0, 1.0, 0.0)),
+		lightPlaneDistance(positionAndRadius, shape, vec4(0.0, 0.0, -1.0, 0.0)));
+}
+
+bool lightInTile(vec4 positionAndRadius, vec4 shape, float minDepth, float maxDepth)
+{
+	vec3 center = positionAndRadius.xyz;
+	float radius = positionAndRadius.w;
+#if LIGHT_TILE_TEST == AABB_TEST
+	vec3 delta = clamp(center, tileAabbMin, tileAabbMax) - center;
+	if(dot(delta, delta) > radius * radius)
+	{
+		return false;
+	}
+#elif LIGHT_TILE_TEST == CONE_TEST
+	if(-center.z + radius < minDepth || -center.z - radius > maxDepth)
+	{
+		return false;
+	}
+	float centerLengthSq = dot(center, center);
+	float axisLength = dot(center, tileConeDirection);
+	float closestDistance = tileConeCos * sqrt(max(centerLengthSq - axisLength * axisLength, 0.0)) - axisLength * tileConeSin;
+	if(closestDistance > radius || axisLength < -radius)
+	{
+		return false;
+	}
+#endif
+#if LIGHT_TILE_TEST != PLANE_TEST
+	// the bounding sphere is exact for point lights
+	if(shape.w == 0.0)
+	{
+		return true;
+	}
+#endif
+	// spot cone or capsule against the tile planes, the whole test for every type with PLANE_TEST
+	for(uint j = 0; j < 6; ++j)
+	{
+		if(lightPlaneDistance(positionAndRadius, shape, frustumPlanes[j]) <= 0.0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
 
-#define TILE_SIZE 16
 layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE, local_size_z = 1) in;
 void main()
 {
-	ivec2 location = ivec2(gl_GlobalInvocationID.xy);
 	ivec2 itemID = ivec2(gl_LocalInvocationID.xy);
 	ivec2 tileID = ivec2(gl_WorkGroupID.xy);
 	ivec2 tileNumber = ivec2(gl_NumWorkGroups.xy);
 	uint index = tileID.y * tileNumber.x + tileID.x;
 
+	// max/min depth of the current tile
+	vec2 depthBounds = texelFetch(tileDepthBounds, tileID, 0).rg;
+	float minDepth = depthBounds.x;
+	float maxDepth = depthBounds.y;
+	uint depthMask = texelFetch(tileDepthMask, tileID, 0).r;
+	float binScale = float(DEPTH_MASK_BINS) / max(maxDepth - minDepth, 1e-6);
+
 	// initialize global values
 	if(gl_LocalInvocationIndex == 0)
 	{
-		minDepthInt = 0xFFFFFFFF;
-		maxDepthInt = 0;
 		visibleLightCount = 0;
-		viewProjection = projection * view;
-	}
-
-	barrier();
-	// find max/min depth in current work group
-	float maxDepth, minDepth;
-	vec2 text = vec2(location) / screenSize;
-	float depth = texture(depthMap, text).r;
-	// Linearize the depth value
-	depth = (0.5 * projection[3][2]) / (0.5 * projection[2][2] + depth - 0.5);
-
-	uint depthInt = floatBitsToUint(depth);
-	atomicMin(minDepthInt, depthInt);
-	atomicMax(maxDepthInt, depthInt);
-
-	barrier();
-
-	if(gl_LocalInvocationIndex == 0)
-	{
-		minDepth = uintBitsToFloat(minDepthInt);
-		maxDepth = uintBitsToFloat(maxDepthInt);
 
 		vec2 negativeStep = (2.0 * vec2(tileID)) / vec2(tileNumber);
 		vec2 positiveStep = (2.0 * vec2(tileID + ivec2(1, 1))) / vec2(tileNumber);
@@ -84,70 +213,133 @@ void main()
 		frustumPlanes[4] = vec4(0.0, 0.0, -1.0, -minDepth); // Near
 		frustumPlanes[5] = vec4(0.0, 0.0, 1.0, maxDepth); // Far
 
-		// Transform the first four planes
+		// Transform the first four planes, the lights are already in view space
 		for(uint i = 0; i < 4; ++i)
 		{
-			frustumPlanes[i] *= viewProjection;
+			frustumPlanes[i] *= projection;
 			frustumPlanes[i] /= length(frustumPlanes[i].xyz);
 		}
 
-		// Transform the depth planes
-		frustumPlanes[4] *= view;
-		frustumPlanes[4] /= length(frustumPlanes[4].xyz);
-		frustumPlanes[5] *= view;
-		frustumPlanes[5] /= length(frustumPlanes[5].xyz);
+		// tile corners in NDC, unprojected to view space rays with z = -1
+		vec2 ndcMin = negativeStep - 1.0;
+		vec2 ndcMax = positiveStep - 1.0;
+		vec2 projectionScale = vec2(projection[0][0], projection[1][1]);
+		vec2 rayMin = ndcMin / projectionScale;
+		vec2 rayMax = ndcMax / projectionScale;
+
+		// the tile frustum spans the rays scaled between min and max depth
+		tileAabbMin = vec3(min(rayMin * minDepth, rayMin * maxDepth), -maxDepth);
+		tileAabbMax = vec3(max(rayMax * minDepth, rayMax * maxDepth), -minDepth);
+
+		// cone around the tile center covering all four corner rays
+		tileConeDirection = normalize(vec3(0.5 * (rayMin + rayMax), -1.0));
+		float coneCos = 1.0;
+		coneCos = min(coneCos, dot(tileConeDirection, normalize(vec3(rayMin.x, rayMin.y, -1.0))));
+		coneCos = min(coneCos, dot(tileConeDirection, normalize(vec3(rayMax.x, rayMin.y, -1.0))));
+		coneCos = min(coneCos, dot(tileConeDirection, normalize(vec3(rayMin.x, rayMax.y, -1.0))));
+		coneCos = min(coneCos, dot(tileConeDirection, normalize(vec3(rayMax.x, rayMax.y, -1.0))));
+		tileConeCos = coneCos;
+		tileConeSin = sqrt(1.0 - coneCos * coneCos);
 	}
 
 	barrier();
 
 	// cull lights
+	uint candidateCount = viewLightCount.count;
+	uint candidateOffset = 0;
+	if(hierarchicalCulling)
+	{
+		ivec2 superTileID = tileID / SUPER_TILE_TILES;
+		uint superTileIndex = superTileID.y * ((tileNumber.x + SUPER_TILE_TILES - 1) / SUPER_TILE_TILES) + superTileID.x;
+		LightGridCell coarse = coarseLightGridBuffer.data[superTileIndex];
+		candidateCount = coarse.count;
+		candidateOffset = coarse.offset;
+	}
+
 	uint threadCount = TILE_SIZE * TILE_SIZE;
-	uint passCount = (lightCount + threadCount - 1) / threadCount;
+	uint passCount = (candidateCount + threadCount - 1) / threadCount;
 	for(uint i = 0; i < passCount; ++i)
 	{
-		uint lightIndex = i * threadCount + gl_LocalInvocationIndex;
-		if(lightIndex >= lightCount)
+		uint candidate = i * threadCount + gl_LocalInvocationIndex;
+		if(candidate >= candidateCount)
 		{
 			break;
 		}
+		uint lightIndex = hierarchicalCulling ? coarseLightIndicesBuffer.data[candidateOffset + candidate] : candidate;
 
-		vec4 position = lightBuffer.data[lightIndex].position;
-		float radius = lightBuffer.data[lightIndex].paddingAndRadius.w;
+		vec4 positionAndRadius = lightBuffer.data[lightIndex];
+		vec4 shape = lightShapeBuffer.data[lightIndex];
 
-		// check light exists in frustum
-		float distance = 0.0f;
-		for(uint j = 0; j < 6; ++j)
+		// check light exists in tile
+		bool visible = lightInTile(positionAndRadius, shape, minDepth, maxDepth);
+		if(visible && depthMaskCulling)
 		{
-			distance = dot(position, frustumPlanes[j]) + radius;
-
-			if(distance <= 0.0)
+			// 2.5D culling, the light must cover at least one occupied depth bin
+			vec2 lightDepth = lightDepthRange(positionAndRadius, shape);
+			uint firstBin = uint(clamp((lightDepth.x - minDepth) * binScale, 0.0, float(DEPTH_MASK_BINS - 1)));
+			uint lastBin = uint(clamp((lightDepth.y - minDepth) * binScale, 0.0, float(DEPTH_MASK_BINS - 1)));
+			uint lightMask = (0xFFFFFFFFu >> (31u - lastBin)) & (0xFFFFFFFFu << firstBin);
+			if((lightMask & depthMask) == 0)
 			{
-				break;
+				atomicAdd(cullingStats.depthMaskRejectedLights, 1);
+				visible = false;
 			}
 		}
-		if(distance > 0.0)
+		if(visible)
 		{
 			// light in frustum
 			uint offset = atomicAdd(visibleLightCount, 1);
-			visibleLightIndices[offset] = int(lightIndex);
+			if(offset < MAX_LIGHTS_PER_TILE)
+			{
+				visibleLightIndices[offset] = int(lightIndex);
+			}
 		}
 	}
 
 	barrier();
 
-	// copy result back to global buffer
+	// allocate a range in the index pool
 	if(gl_LocalInvocationIndex == 0)
 	{
-		uint offset = index * 1024;
-		for(uint i = 0; i < visibleLightCount; ++i)
+		// the shared list keeps the first MAX_LIGHTS_PER_TILE lights
+		uint count = min(visibleLightCount, MAX_LIGHTS_PER_TILE);
+		if(visibleLightCount > count)
+		{
+			atomicAdd(cullingStats.overflowedLights, visibleLightCount - count);
+		}
+		uint words = packedIndices ? (count + 1) / 2 : count;
+		uint offset = atomicAdd(lightIndexCounter.next, words);
+
+		// clamp the list if the pool is exhausted
+		uint available = offset < indexPoolSize ? indexPoolSize - offset : 0u;
+		if(words > available)
 		{
-			visibleLightIndicesBuffer.data[offset + i].index = visibleLightIndices[i];
+			words = available;
+			uint kept = packedIndices ? words * 2 : words;
+			atomicAdd(cullingStats.poolOverflowedLights, count - kept);
+			count = kept;
 		}
 
-		if(visibleLightCount != 1024)
+		tileOffset = offset;
+		tileWords = words;
+		lightGridBuffer.data[index].offset = offset;
+		lightGridBuffer.data[index].count = count;
+	}
+
+	barrier();
+
+	// copy result back to global buffer, spread over the whole work group
+	for(uint i = gl_LocalInvocationIndex; i < tileWords; i += threadCount)
+	{
+		if(packedIndices)
+		{
+			uint low = uint(visibleLightIndices[2 * i]);
+			uint high = 2 * i + 1 < min(visibleLightCount, MAX_LIGHTS_PER_TILE) ? uint(visibleLightIndices[2 * i + 1]) : 0xFFFFu;
+			visibleLightIndicesBuffer.data[tileOffset + i] = low | (high << 16);
+		}
+		else
 		{
-			visibleLightIndicesBuffer.data[offset + visibleLightCount].index = -1;
+			visibleLightIndicesBuffer.data[tileOffset + i] = uint(visibleLightIndices[i]);
 		}
 	}
-    
 }
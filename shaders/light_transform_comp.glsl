@@ -0,0 +1,324 @@
+#version 430
+
+// storage buffer objects
+// world space xyz position, w radius
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+// RGBA as four half floats, same order as lightBuffer
+layout (std430, binding = 10) readonly buffer LightColorBuffer {
+	uvec2 data[];
+} lightColorBuffer;
+
+// light type and volume, w == 0 point, w > 0 spot with the cosine of the cone angle and xyz direction,
+// w < 0 capsule with minus the range and xyz half segment, see Light in LightCulling.hpp
+layout (std430, binding = 15) readonly buffer LightShapeBuffer {
+	vec4 data[];
+} lightShapeBuffer;
+
+// view space xyz position, w radius of the lights in the camera frustum, read by culling and shading
+layout (std430, binding = 11) writeonly buffer ViewLightBuffer {
+	vec4 data[];
+} viewLightBuffer;
+
+layout (std430, binding = 12) writeonly buffer ViewLightColorBuffer {
+	uvec2 data[];
+} viewLightColorBuffer;
+
+// view space shapes, the direction and segment rotate with the view
+layout (std430, binding = 16) writeonly buffer ViewLightShapeBuffer {
+	vec4 data[];
+} viewLightShapeBuffer;
+
+// index in lightBuffer of every view light
+layout (std430, binding = 13) writeonly buffer ViewLightSourceBuffer {
+	uint data[];
+} viewLightSourceBuffer;
+
+// number of view lights, cleared every frame
+layout (std430, binding = 14) buffer ViewLightCount {
+	uint count;
+} viewLightCount;
+
+// importance LOD fade of every scene light, 0 dropped and 1 fully shaded
+layout (std430, binding = 17) buffer LightFadeBuffer {
+	float data[];
+} lightFadeBuffer;
+
+// scene light of every entry in lightBuffer when it is the depth sorted copy
+layout (std430, binding = 18) readonly buffer SortedLightSourceBuffer {
+	uint data[];
+} sortedLightSourceBuffer;
+
+#ifdef STATIC_LIGHT_GRID
+struct LightGridCell {
+	uint offset;
+	uint count;
+};
+
+// frame stamp of the last gather per light, a light overlapping several visible cells is emitted once
+layout (std430, binding = 19) buffer LightStampBuffer {
+	uint data[];
+} lightStampBuffer;
+
+// world space uniform grid over the static lights, built on the CPU when they change
+layout (std430, binding = 20) readonly buffer StaticLightGridBuffer {
+	LightGridCell data[];
+} staticLightGridBuffer;
+
+layout (std430, binding = 21) readonly buffer StaticLightIndicesBuffer {
+	uint data[];
+} staticLightIndicesBuffer;
+#endif
+
+// uniform
+uniform mat4 view;
+uniform mat4 projection;
+uniform int lightCount;
+uniform float near;
+uniform float far;
+// drop the lights outside the frustum, otherwise every light keeps its slot for the Z bins
+uniform bool compactLights;
+uniform bool sortedLights;
+uniform ivec2 screenSize;
+// lights with a lower importance fade out, 0 keeps every light
+uniform float lodThreshold;
+// fade change of this frame
+uniform float lodFadeStep;
+// the per light pass starts here, the lights before it are static and gathered from the grid
+uniform int firstLight;
+#ifdef STATIC_LIGHT_GRID
+uniform vec3 gridMin;
+uniform vec3 gridCellSize;
+uniform ivec3 gridDimensions;
+// changes every frame, never 0
+uniform uint frameStamp;
+#endif
+
+#ifdef STATIC_LIGHT_GRID
+// a work group gathers the lights of one grid cell
+#define GROUP_SIZE 64
+#else
+#define GROUP_SIZE 256
+#endif
+// lights fade back in above the threshold and out below this share of it
+#define LOD_HYSTERESIS 0.75
+
+// shared values
+shared vec4 frustumPlanes[6];
+// slots of this work group in the view light list
+shared uint groupLightCount;
+shared uint groupOffset;
+#ifdef STATIC_LIGHT_GRID
+shared bool cellVisible;
+#endif
+
+// signed distance of the farthest point of the light volume to a normalized plane, outside when <= 0,
+// must match LightPlaneDistance in LightCulling.hpp
+float lightPlaneDistance(vec4 positionAndRadius, vec4 shape, vec4 plane)
+{
+	float center = dot(positionAndRadius.xyz, plane.xyz) + plane.w;
+	float sphere = center + positionAndRadius.w;
+	float axis = dot(shape.xyz, plane.xyz);
+	if(shape.w > 0.0)
+	{
+		// spot cone clipped to the range sphere, the apex or the rim of the base is farthest
+		float range = positionAndRadius.w;
+		float baseRadius = range * sqrt(1.0 - shape.w * shape.w) / shape.w;
+		float base = center + range * axis + baseRadius * sqrt(max(1.0 - axis * axis, 0.0));
+		return min(sphere, max(center, base));
+	}
+	if(shape.w < 0.0)
+	{
+		// capsule, the farther segment end plus the range
+		return center + abs(axis) - shape.w;
+	}
+	return sphere;
+}
+
+// view space light of this frame
+struct ViewLight {
+	vec4 positionAndRadius;
+	vec4 shape;
+	uvec2 color;
+	uint sourceIndex;
+};
+
+// Transforms a light to view space, tests it against the camera frustum and advances its LOD fade,
+// true if the light is shaded this frame
+bool prepareLight(uint lightIndex, out ViewLight light)
+{
+	light.positionAndRadius = lightBuffer.data[lightIndex];
+	light.positionAndRadius.xyz = (view * vec4(light.positionAndRadius.xyz, 1.0)).xyz;
+	light.shape = lightShapeBuffer.data[lightIndex];
+	light.shape.xyz = mat3(view) * light.shape.xyz;
+
+	bool visible = true;
+	for(uint j = 0; j < 6; ++j)
+	{
+		if(lightPlaneDistance(light.positionAndRadius, light.shape, frustumPlanes[j]) <= 0.0)
+		{
+			visible = false;
+			break;
+		}
+	}
+
+	// importance LOD, projected radius in pixels times the brightest channel, tracked per scene light
+	// so the fade survives the Z-bin sort
+	light.sourceIndex = sortedLights ? sortedLightSourceBuffer.data[lightIndex] : lightIndex;
+	uvec2 color = lightColorBuffer.data[lightIndex];
+	vec4 lightColor = vec4(unpackHalf2x16(color.x), unpackHalf2x16(color.y));
+	float pixelScale = 0.5 * float(screenSize.y) * projection[1][1];
+	float projectedRadius = light.positionAndRadius.w * pixelScale / max(-light.positionAndRadius.z, near);
+	float importance = projectedRadius * max(lightColor.r, max(lightColor.g, lightColor.b));
+
+	float fade = lightFadeBuffer.data[light.sourceIndex];
+	if(importance >= lodThreshold)
+	{
+		fade = min(fade + lodFadeStep, 1.0);
+	}
+	else if(importance < lodThreshold * LOD_HYSTERESIS)
+	{
+		fade = max(fade - lodFadeStep, 0.0);
+	}
+	lightFadeBuffer.data[light.sourceIndex] = fade;
+
+	light.color = uvec2(packHalf2x16(lightColor.rg * fade), packHalf2x16(vec2(lightColor.b * fade, lightColor.a)));
+	return visible && fade > 0.0;
+}
+
+void writeViewLight(uint viewIndex, ViewLight light)
+{
+	viewLightBuffer.data[viewIndex] = light.positionAndRadius;
+	viewLightShapeBuffer.data[viewIndex] = light.shape;
+	viewLightColorBuffer.data[viewIndex] = light.color;
+	viewLightSourceBuffer.data[viewIndex] = light.sourceIndex;
+}
+
+// Appends the visible lights of the work group to the view light list, compacting within the work group
+// first so there is one global atomic per group. Must be reached by the whole work group.
+void appendViewLight(bool visible, ViewLight light)
+{
+	if(gl_LocalInvocationIndex == 0)
+	{
+		groupLightCount = 0;
+	}
+
+	barrier();
+
+	uint slot = 0;
+	if(visible)
+	{
+		slot = atomicAdd(groupLightCount, 1);
+	}
+
+	barrier();
+
+	if(gl_LocalInvocationIndex == 0)
+	{
+		groupOffset = atomicAdd(viewLightCount.count, groupLightCount);
+	}
+
+	barrier();
+
+	if(visible)
+	{
+		writeViewLight(groupOffset + slot, light);
+	}
+}
+
+layout(local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	if(gl_LocalInvocationIndex == 0)
+	{
+		// view space planes of the camera frustum
+		frustumPlanes[0] = vec4(1.0, 0.0, 0.0, 1.0) * projection; // Left
+		frustumPlanes[1] = vec4(-1.0, 0.0, 0.0, 1.0) * projection; // Right
+		frustumPlanes[2] = vec4(0.0, 1.0, 0.0, 1.0) * projection; // Bottom
+		frustumPlanes[3] = vec4(0.0, -1.0, 0.0, 1.0) * projection; // Top
+		for(uint i = 0; i < 4; ++i)
+		{
+			frustumPlanes[i] /= length(frustumPlanes[i].xyz);
+		}
+		frustumPlanes[4] = vec4(0.0, 0.0, -1.0, -near); // Near
+		frustumPlanes[5] = vec4(0.0, 0.0, 1.0, far); // Far
+
+#ifdef STATIC_LIGHT_GRID
+		// cell box against the frustum, the view space planes brought back to world space
+		uvec3 dimensions = uvec3(gridDimensions);
+		uint cellIndex = gl_WorkGroupID.x;
+		uvec3 cellID = uvec3(cellIndex % dimensions.x, (cellIndex / dimensions.x) % dimensions.y, cellIndex / (dimensions.x * dimensions.y));
+		vec3 cellMin = gridMin + vec3(cellID) * gridCellSize;
+		vec3 cellMax = cellMin + gridCellSize;
+		cellVisible = true;
+		for(uint j = 0; j < 6; ++j)
+		{
+			vec4 plane = frustumPlanes[j] * view;
+			// the box corner farthest along the plane normal
+			vec3 corner = mix(cellMin, cellMax, greaterThan(plane.xyz, vec3(0.0)));
+			if(dot(plane.xyz, corner) + plane.w <= 0.0)
+			{
+				cellVisible = false;
+				break;
+			}
+		}
+#endif
+	}
+
+	barrier();
+
+#ifdef STATIC_LIGHT_GRID
+	// gather the static lights of a visible cell, the loop bounds are the same for the whole group
+	if(!cellVisible)
+	{
+		return;
+	}
+	LightGridCell cell = staticLightGridBuffer.data[gl_WorkGroupID.x];
+	for(uint i = 0; i < cell.count; i += GROUP_SIZE)
+	{
+		ViewLight light;
+		bool visible = false;
+		if(i + gl_LocalInvocationIndex < cell.count)
+		{
+			uint lightIndex = staticLightIndicesBuffer.data[cell.offset + i + gl_LocalInvocationIndex];
+			// first visit of the light this frame
+			if(atomicExchange(lightStampBuffer.data[lightIndex], frameStamp) != frameStamp)
+			{
+				visible = prepareLight(lightIndex, light);
+			}
+		}
+		appendViewLight(visible, light);
+	}
+#else
+	uint lightIndex = firstLight + gl_GlobalInvocationID.x;
+	ViewLight light;
+	bool visible = false;
+	if(lightIndex < lightCount)
+	{
+		visible = prepareLight(lightIndex, light);
+	}
+
+	if(!compactLights)
+	{
+		if(lightIndex < lightCount)
+		{
+			// park culled lights behind the camera where every tile test rejects them
+			if(!visible)
+			{
+				light.positionAndRadius = vec4(0.0, 0.0, 1.0, 0.0);
+				light.shape = vec4(0.0);
+			}
+			writeViewLight(lightIndex, light);
+		}
+		if(lightIndex == 0)
+		{
+			viewLightCount.count = uint(lightCount);
+		}
+		return;
+	}
+
+	appendViewLight(visible, light);
+#endif
+}
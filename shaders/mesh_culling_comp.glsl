@@ -0,0 +1,112 @@
+#version 430
+
+// Culls the meshes of a model against the camera frustum and the depth pyramid of the previous prepass and
+// appends the draw commands of the rest for the depth prepass and the final pass
+
+struct DrawCommand {
+	uint count;
+	uint instanceCount;
+	uint firstIndex;
+	int baseVertex;
+	uint baseInstance;
+};
+
+// model space box of every mesh, see MeshBounds in Model.hpp
+struct MeshBounds {
+	vec4 aabbMin;
+	vec4 aabbMax;
+};
+
+// storage buffer objects
+layout (std430, binding = 31) readonly buffer MeshBoundsBuffer {
+	MeshBounds data[];
+} meshBoundsBuffer;
+
+// one command per mesh, in the order of the bounds
+layout (std430, binding = 32) readonly buffer DrawCommandBuffer {
+	DrawCommand data[];
+} drawCommandBuffer;
+
+// the commands of the meshes left, compacted
+layout (std430, binding = 33) writeonly buffer VisibleCommandBuffer {
+	DrawCommand data[];
+} visibleCommandBuffer;
+
+// number of visible commands, cleared every frame
+layout (std430, binding = 34) buffer DrawCountBuffer {
+	uint count;
+} drawCountBuffer;
+
+// uniform
+uniform mat4 modelViewProjection;
+uniform int meshCount;
+// min/max depth per texel, see depth_pyramid_comp.glsl
+uniform sampler2D depthPyramid;
+uniform int pyramidLevels;
+uniform ivec2 screenSize;
+// false until the pyramid holds a prepass
+uniform bool occlusionCulling;
+
+#define GROUP_SIZE 64
+
+layout(local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint meshIndex = gl_GlobalInvocationID.x;
+	if(meshIndex >= meshCount)
+	{
+		return;
+	}
+	MeshBounds bounds = meshBoundsBuffer.data[meshIndex];
+
+	// clip space corners of the box, culled when all of them are outside one frustum plane
+	ivec3 outsideMin = ivec3(0);
+	ivec3 outsideMax = ivec3(0);
+	bool behindCamera = false;
+	vec3 ndcMin = vec3(1.0);
+	vec3 ndcMax = vec3(-1.0);
+	for(int i = 0; i < 8; ++i)
+	{
+		vec3 corner = mix(bounds.aabbMin.xyz, bounds.aabbMax.xyz, bvec3((i & 1) != 0, (i & 2) != 0, (i & 4) != 0));
+		vec4 clip = modelViewProjection * vec4(corner, 1.0);
+		outsideMin += ivec3(lessThan(clip.xyz, vec3(-clip.w)));
+		outsideMax += ivec3(greaterThan(clip.xyz, vec3(clip.w)));
+		if(clip.w <= 0.0)
+		{
+			behindCamera = true;
+		}
+		else
+		{
+			ndcMin = min(ndcMin, clip.xyz / clip.w);
+			ndcMax = max(ndcMax, clip.xyz / clip.w);
+		}
+	}
+	if(any(equal(outsideMin, ivec3(8))) || any(equal(outsideMax, ivec3(8))))
+	{
+		return;
+	}
+
+	// occluded when the nearest point of the box is behind the farthest depth of the pyramid texels under
+	// its screen rectangle, a box crossing the camera plane has no such rectangle and is kept
+	if(occlusionCulling && !behindCamera)
+	{
+		vec2 pixelMin = clamp((ndcMin.xy * 0.5 + 0.5) * vec2(screenSize), vec2(0.0), vec2(screenSize - 1));
+		vec2 pixelMax = clamp((ndcMax.xy * 0.5 + 0.5) * vec2(screenSize), vec2(0.0), vec2(screenSize - 1));
+		// the level where the rectangle spans at most 2x2 texels
+		float extent = max(max(pixelMax.x - pixelMin.x, pixelMax.y - pixelMin.y), 1.0);
+		int level = clamp(int(ceil(log2(extent))) - 1, 0, pyramidLevels - 1);
+		ivec2 levelSize = textureSize(depthPyramid, level);
+		ivec2 texelMin = min(ivec2(pixelMin) >> (level + 1), levelSize - 1);
+		ivec2 texelMax = min(ivec2(pixelMax) >> (level + 1), levelSize - 1);
+		float farthestDepth = max(max(texelFetch(depthPyramid, texelMin, level).g, texelFetch(depthPyramid, ivec2(texelMax.x, texelMin.y), level).g),
+			max(texelFetch(depthPyramid, ivec2(texelMin.x, texelMax.y), level).g, texelFetch(depthPyramid, texelMax, level).g));
+		float nearestDepth = ndcMin.z * 0.5 + 0.5;
+		if(nearestDepth > farthestDepth)
+		{
+			return;
+		}
+	}
+
+	uint slot = atomicAdd(drawCountBuffer.count, 1);
+	visibleCommandBuffer.data[slot] = drawCommandBuffer.data[meshIndex];
+}
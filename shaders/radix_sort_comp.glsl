@@ -0,0 +1,133 @@
+#version 430
+
+// One 4 bit pass of a stable least significant digit radix sort of key/value pairs, one stage per define:
+//   RADIX_HISTOGRAM  digit counts of every block of GROUP_SIZE keys
+//   RADIX_SCAN       exclusive scan of the counts, digit major so equal digits keep the block order
+//   default          scatter of every key to its scanned offset plus its rank in the block
+
+// storage buffer objects
+layout (std430, binding = 22) readonly buffer KeyInBuffer {
+	uint data[];
+} keyInBuffer;
+
+layout (std430, binding = 23) readonly buffer ValueInBuffer {
+	uint data[];
+} valueInBuffer;
+
+layout (std430, binding = 24) writeonly buffer KeyOutBuffer {
+	uint data[];
+} keyOutBuffer;
+
+layout (std430, binding = 25) writeonly buffer ValueOutBuffer {
+	uint data[];
+} valueOutBuffer;
+
+// count of digit d in block b at d * blockCount + b, scanned in place
+layout (std430, binding = 26) buffer RadixHistogramBuffer {
+	uint data[];
+} radixHistogramBuffer;
+
+// number of keys
+layout (std430, binding = 14) readonly buffer ViewLightCount {
+	uint count;
+} viewLightCount;
+
+// uniform
+// lowest bit of the digit of this pass
+uniform uint shift;
+uniform uint blockCount;
+
+#define GROUP_SIZE 256
+#define RADIX_BITS 4
+#define RADIX (1 << RADIX_BITS)
+// past every digit, keys beyond the count
+#define NO_DIGIT RADIX
+
+// shared values
+shared uint digitCounts[RADIX];
+shared uint blockDigits[GROUP_SIZE];
+shared uint partialSums[GROUP_SIZE];
+
+layout(local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+	uint localIndex = gl_LocalInvocationIndex;
+
+#if defined(RADIX_HISTOGRAM)
+	if(localIndex < RADIX)
+	{
+		digitCounts[localIndex] = 0;
+	}
+
+	barrier();
+
+	if(index < viewLightCount.count)
+	{
+		atomicAdd(digitCounts[(keyInBuffer.data[index] >> shift) & (RADIX - 1)], 1);
+	}
+
+	barrier();
+
+	if(localIndex < RADIX)
+	{
+		radixHistogramBuffer.data[localIndex * blockCount + gl_WorkGroupID.x] = digitCounts[localIndex];
+	}
+#elif defined(RADIX_SCAN)
+	// a single work group, every thread sums a contiguous segment
+	uint total = RADIX * blockCount;
+	uint segment = (total + GROUP_SIZE - 1) / GROUP_SIZE;
+	uint first = min(localIndex * segment, total);
+	uint last = min(first + segment, total);
+	uint sum = 0;
+	for(uint i = first; i < last; ++i)
+	{
+		sum += radixHistogramBuffer.data[i];
+	}
+	partialSums[localIndex] = sum;
+
+	barrier();
+
+	// inclusive scan of the segment sums
+	for(uint offset = 1; offset < GROUP_SIZE; offset *= 2)
+	{
+		uint value = localIndex >= offset ? partialSums[localIndex - offset] : 0;
+		barrier();
+		partialSums[localIndex] += value;
+		barrier();
+	}
+
+	uint prefix = partialSums[localIndex] - sum;
+	for(uint i = first; i < last; ++i)
+	{
+		uint count = radixHistogramBuffer.data[i];
+		radixHistogramBuffer.data[i] = prefix;
+		prefix += count;
+	}
+#else
+	uint key = 0;
+	uint digit = NO_DIGIT;
+	if(index < viewLightCount.count)
+	{
+		key = keyInBuffer.data[index];
+		digit = (key >> shift) & (RADIX - 1);
+	}
+	blockDigits[localIndex] = digit;
+
+	barrier();
+
+	if(digit == NO_DIGIT)
+	{
+		return;
+	}
+	// keys of the block before this one with the same digit keep their order
+	uint rank = 0;
+	for(uint i = 0; i < localIndex; ++i)
+	{
+		rank += blockDigits[i] == digit ? 1 : 0;
+	}
+	uint destination = radixHistogramBuffer.data[digit * blockCount + gl_WorkGroupID.x] + rank;
+	keyOutBuffer.data[destination] = key;
+	valueOutBuffer.data[destination] = valueInBuffer.data[index];
+#endif
+}
@@ -0,0 +1,143 @@
+#version 430
+
+// storage buffer objects
+// view space xyz position and w radius of the lights sorted by view depth in zbin_sort_comp.glsl, bit i of a tile mask is light i,
+// light_transform_comp.glsl keeps the order and parks the lights outside the frustum behind the camera
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+// w == 0 point, w > 0 spot with the cosine of the cone angle and xyz direction,
+// w < 0 capsule with minus the range and xyz half segment, see Light in LightCulling.hpp
+layout(std430, binding = 15) readonly buffer LightShapeBuffer{
+	vec4 data[];
+} lightShapeBuffer;
+
+// one bit per light per tile, lightWords uints per tile
+layout(std430, binding = 7) writeonly buffer TileLightMaskBuffer{
+	uint data[];
+} tileLightMaskBuffer;
+
+// uniform
+// linear min/max view depth per tile from depth_reduction_comp.glsl
+uniform sampler2D tileDepthBounds;
+uniform mat4 projection;
+uniform int lightCount;
+
+// default, Window.cpp injects the configured tile size when loading the shader
+#ifndef TILE_SIZE
+#define TILE_SIZE 16
+#endif
+// 32 lights per word, Window.cpp injects the word count covering NUM_LIGHTS
+#ifndef MAX_LIGHT_WORDS
+#define MAX_LIGHT_WORDS 32
+#endif
+
+// shared values
+shared vec4 frustumPlanes[6];
+// shared local storage for the light mask of this tile
+shared uint tileLightMask[MAX_LIGHT_WORDS];
+
+// signed distance of the farthest point of the light volume to a normalized plane, outside when <= 0,
+// must match LightPlaneDistance in LightCulling.hpp
+float lightPlaneDistance(vec4 positionAndRadius, vec4 shape, vec4 plane)
+{
+	float center = dot(positionAndRadius.xyz, plane.xyz) + plane.w;
+	float sphere = center + positionAndRadius.w;
+	float axis = dot(shape.xyz, plane.xyz);
+	if(shape.w > 0.0)
+	{
+		// spot cone clipped to the range sphere, the apex or the rim of the base is farthest
+		float range = positionAndRadius.w;
+		float baseRadius = range * sqrt(1.0 - shape.w * shape.w) / shape.w;
+		float base = center + range * axis + baseRadius * sqrt(max(1.0 - axis * axis, 0.0));
+		return min(sphere, max(center, base));
+	}
+	if(shape.w < 0.0)
+	{
+		// capsule, the farther segment end plus the range
+		return center + abs(axis) - shape.w;
+	}
+	return sphere;
+}
+
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE, local_size_z = 1) in;
+void main()
+{
+	ivec2 tileID = ivec2(gl_WorkGroupID.xy);
+	ivec2 tileNumber = ivec2(gl_NumWorkGroups.xy);
+	uint index = tileID.y * tileNumber.x + tileID.x;
+	uint threadCount = TILE_SIZE * TILE_SIZE;
+
+	// initialize global values
+	for(uint i = gl_LocalInvocationIndex; i < MAX_LIGHT_WORDS; i += threadCount)
+	{
+		tileLightMask[i] = 0;
+	}
+
+	if(gl_LocalInvocationIndex == 0)
+	{
+		// max/min depth of the current tile
+		vec2 depthBounds = texelFetch(tileDepthBounds, tileID, 0).rg;
+		float minDepth = depthBounds.x;
+		float maxDepth = depthBounds.y;
+
+		vec2 negativeStep = (2.0 * vec2(tileID)) / vec2(tileNumber);
+		vec2 positiveStep = (2.0 * vec2(tileID + ivec2(1, 1))) / vec2(tileNumber);
+
+		// Set up starting values for planes using steps and min and max z values
+		frustumPlanes[0] = vec4(1.0, 0.0, 0.0, 1.0 - negativeStep.x); // Left
+		frustumPlanes[1] = vec4(-1.0, 0.0, 0.0, -1.0 + positiveStep.x); // Right
+		frustumPlanes[2] = vec4(0.0, 1.0, 0.0, 1.0 - negativeStep.y); // Bottom
+		frustumPlanes[3] = vec4(0.0, -1.0, 0.0, -1.0 + positiveStep.y); // Top
+		frustumPlanes[4] = vec4(0.0, 0.0, -1.0, -minDepth); // Near
+		frustumPlanes[5] = vec4(0.0, 0.0, 1.0, maxDepth); // Far
+
+		// Transform the first four planes, the lights are already in view space
+		for(uint i = 0; i < 4; ++i)
+		{
+			frustumPlanes[i] *= projection;
+			frustumPlanes[i] /= length(frustumPlanes[i].xyz);
+		}
+	}
+
+	barrier();
+
+	// cull lights, setting the bit of every visible light
+	uint passCount = (lightCount + threadCount - 1) / threadCount;
+	for(uint i = 0; i < passCount; ++i)
+	{
+		uint lightIndex = i * threadCount + gl_LocalInvocationIndex;
+		if(lightIndex >= lightCount)
+		{
+			break;
+		}
+
+		vec4 positionAndRadius = lightBuffer.data[lightIndex];
+		vec4 shape = lightShapeBuffer.data[lightIndex];
+
+		// check light exists in frustum
+		float distance = 0.0f;
+		for(uint j = 0; j < 6; ++j)
+		{
+			distance = lightPlaneDistance(positionAndRadius, shape, frustumPlanes[j]);
+
+			if(distance <= 0.0)
+			{
+				break;
+			}
+		}
+		if(distance > 0.0)
+		{
+			atomicOr(tileLightMask[lightIndex / 32], 1u << (lightIndex % 32));
+		}
+	}
+
+	barrier();
+
+	// copy result back to global buffer, MAX_LIGHT_WORDS is the lightWords stride of the final pass
+	for(uint i = gl_LocalInvocationIndex; i < MAX_LIGHT_WORDS; i += threadCount)
+	{
+		tileLightMaskBuffer.data[index * MAX_LIGHT_WORDS + i] = tileLightMask[i];
+	}
+}
@@ -0,0 +1,127 @@
+#version 430
+
+// Sorts the lights by view depth for the Z-binned mode and builds its depth bins, one stage per define:
+//   DEPTH_KEYS  sortable view depth of every light, sorted by radix_sort_comp.glsl afterwards
+//   default     the lights copied into depth order and the sorted range touching every depth bin
+
+// first and last depth sorted light overlapping a depth bin, empty when first > last, cleared to empty
+struct ZBin {
+	uint first;
+	uint last;
+};
+
+// storage buffer objects
+// world space xyz position, w radius
+layout (std430, binding = 0) readonly buffer LightBuffer {
+	vec4 data[];
+} lightBuffer;
+
+layout (std430, binding = 10) readonly buffer LightColorBuffer {
+	uvec2 data[];
+} lightColorBuffer;
+
+layout (std430, binding = 15) readonly buffer LightShapeBuffer {
+	vec4 data[];
+} lightShapeBuffer;
+
+// number of keys, every light
+layout (std430, binding = 14) buffer ViewLightCount {
+	uint count;
+} viewLightCount;
+
+// depth keys and the light of each, sorted after the first stage
+layout (std430, binding = 22) buffer DepthKeyBuffer {
+	uint data[];
+} depthKeyBuffer;
+
+layout (std430, binding = 23) buffer DepthValueBuffer {
+	uint data[];
+} depthValueBuffer;
+
+layout (std430, binding = 8) buffer ZBinBuffer {
+	ZBin data[];
+} zBinBuffer;
+
+// the lights in depth order, the input of the transform pass in the Z-binned mode
+layout (std430, binding = 11) writeonly buffer SortedLightBuffer {
+	vec4 data[];
+} sortedLightBuffer;
+
+layout (std430, binding = 12) writeonly buffer SortedLightColorBuffer {
+	uvec2 data[];
+} sortedLightColorBuffer;
+
+layout (std430, binding = 16) writeonly buffer SortedLightShapeBuffer {
+	vec4 data[];
+} sortedLightShapeBuffer;
+
+layout (std430, binding = 18) writeonly buffer SortedLightSourceBuffer {
+	uint data[];
+} sortedLightSourceBuffer;
+
+// uniform
+uniform mat4 view;
+uniform int lightCount;
+uniform float near;
+uniform float far;
+
+#define GROUP_SIZE 256
+// must match Z_BINS in Window.cpp
+#define Z_BINS 64
+
+// same exponential slicing as final_shading_frag.glsl
+uint depthSlice(float viewDepth, uint sliceCount)
+{
+	float slice = log(max(viewDepth, near) / near) * float(sliceCount) / log(far / near);
+	return uint(clamp(slice, 0.0, float(sliceCount - 1)));
+}
+
+float viewDepth(vec4 positionAndRadius)
+{
+	return -(view * vec4(positionAndRadius.xyz, 1.0)).z;
+}
+
+layout(local_size_x = GROUP_SIZE, local_size_y = 1, local_size_z = 1) in;
+void main()
+{
+	uint index = gl_GlobalInvocationID.x;
+
+#if defined(DEPTH_KEYS)
+	if(index == 0)
+	{
+		viewLightCount.count = uint(lightCount);
+	}
+	if(index >= lightCount)
+	{
+		return;
+	}
+	// float bits in unsigned order, the lights behind the camera have negative depths
+	uint bits = floatBitsToUint(viewDepth(lightBuffer.data[index]));
+	depthKeyBuffer.data[index] = (bits & 0x80000000u) != 0 ? ~bits : bits | 0x80000000u;
+	depthValueBuffer.data[index] = index;
+#else
+	if(index >= lightCount)
+	{
+		return;
+	}
+	uint light = depthValueBuffer.data[index];
+	vec4 positionAndRadius = lightBuffer.data[light];
+	sortedLightBuffer.data[index] = positionAndRadius;
+	sortedLightColorBuffer.data[index] = lightColorBuffer.data[light];
+	sortedLightShapeBuffer.data[index] = lightShapeBuffer.data[light];
+	sortedLightSourceBuffer.data[index] = light;
+
+	float depth = viewDepth(positionAndRadius);
+	float radius = positionAndRadius.w;
+	if(depth + radius < near || depth - radius > far)
+	{
+		return;
+	}
+	uint lastBin = depthSlice(depth + radius, Z_BINS);
+	for(uint bin = depthSlice(depth - radius, Z_BINS); bin <= lastBin; ++bin)
+	{
+		atomicMin(zBinBuffer.data[bin].first, index);
+		atomicMax(zBinBuffer.data[bin].last, index);
+	}
+#endif
+}